@@ -0,0 +1,98 @@
+#ifndef BLOB_ARENA_H
+#define BLOB_ARENA_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <new>
+
+#include "mmap_alloc.h"
+
+/*
+ * Allocator for small variable-size blobs (eg the state of string aggregators), on top of a mmap_alloc, so that the
+ * blobs may be backed by the swap files too
+ *
+ * Sizes are rounded up to size classes: multiples of 8 up to 32 bytes, then 4 classes per power of 2 (40, 48, 56, 64,
+ * 80, 96...), so that at most 1/5 of a block is lost
+ * A freed block goes to the free list of its class, and is reused by the next allocation of that class
+ * There is no header: the caller gives the size of the block when freeing it, or any size of the same class (eg
+ * the size of the data it holds, if the block was allocated for a smaller size), see block_size()
+ */
+
+class blob_arena
+{
+private:
+	mmap_alloc mem;
+	std::vector< void * > free_list;	/* first free block of each class, linked through their first 8 bytes */
+
+	/* return the class of size, set block to the size of the blocks of that class */
+	static unsigned size_class( size_t size, size_t *block )
+	{
+		if ( size <= 32 )
+		{
+			*block = ( size <= 8 ? 8 : ( size + 7 ) & ~(size_t)7 );
+			return *block / 8 - 1;
+		}
+
+		/* 2^log < size <= 2^(log+1) */
+		unsigned log = 63 - __builtin_clzll( size - 1 );
+		size_t step = (size_t)1 << ( log - 2 );
+		*block = ( size + step - 1 ) & ~( step - 1 );
+
+		return 4 * ( log - 4 ) + ( *block >> ( log - 2 ) ) - 5;
+	}
+
+public:
+	explicit blob_arena( const std::string &dir ) :
+		mem( dir ),
+		free_list()
+	{
+	}
+
+	/* size of the block allocated for size bytes */
+	static size_t block_size( size_t size )
+	{
+		size_t block;
+		size_class( size, &block );
+		return block;
+	}
+
+	/* allocate a block of block_size( size ) bytes, 8-byte aligned */
+	void *alloc( size_t size )
+	{
+		size_t block;
+		unsigned c = size_class( size, &block );
+
+		if ( c < free_list.size() && free_list[ c ] )
+		{
+			void *p = free_list[ c ];
+			memcpy( &free_list[ c ], p, sizeof(void *) );
+			return p;
+		}
+
+		void *p = mem.alloc( block, 8 );
+		if ( !p )
+			throw std::bad_alloc();
+
+		return p;
+	}
+
+	/* release a block allocated for size bytes (or for any size of the same class) */
+	void free( void *ptr, size_t size )
+	{
+		size_t block;
+		unsigned c = size_class( size, &block );
+
+		if ( c >= free_list.size() )
+			free_list.resize( c + 1, NULL );
+
+		memcpy( ptr, &free_list[ c ], sizeof(void *) );
+		free_list[ c ] = ptr;
+	}
+
+private:
+	blob_arena ( const blob_arena& );
+	blob_arena& operator=( const blob_arena& );
+};
+
+#endif
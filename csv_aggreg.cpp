@@ -9,12 +9,19 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <deque>
+#include <math.h>
 
 #include "output_buffer.h"
 #include "csv_reader.h"
 #include "mmap_alloc.h"
 #include "murmur3.h"
 #include "page_tree.h"
+#include "swiss_table.h"
+#include "blob_arena.h"
+#include "csv_number.h"
+#include "hyperloglog.h"
 
 #define CSV_AGGREG_VERSION "20140414"
 
@@ -24,8 +31,8 @@
 union u_data {
 	long long ll;
 	char *key;
-	std::string *str;
-	std::vector< std::string > *vec_str;
+	char *blob;	// allocated in the blob_arena of the partition
+	double d;
 };
 
 /*
@@ -41,18 +48,7 @@ static void str_key( char **field, size_t *field_len )
 static void key_out( u_data *ptr, output_buffer &out )
 {
 	out.append( '"' );
-	size_t len = strlen( ptr->key );
-	char *tmp = ptr->key, *tmp2;
-	while ( len > 0 && (tmp2 = (char *)memchr( tmp, '"', len )) )
-	{
-		++tmp2;
-		out.append( tmp, tmp2 - tmp );
-		out.append( '"' );
-		len -= tmp2 - tmp;
-		tmp = tmp2;
-	}
-	if ( len > 0 )
-		out.append( tmp, len );
+	out.append_escaped_data( ptr->key, strlen( ptr->key ) );
 	out.append( '"' );
 }
 
@@ -62,117 +58,630 @@ static void downcase_key( char **field, size_t *field_len )
 		(*field)[ i ] = tolower( (*field)[ i ] );
 }
 
-static void top20_aggreg( u_data *ptr, const std::string *field, int first )
+// strtoll( field, 0, 0 ) on a field that is not nul-terminated
+static long long field_ll( const char *field, size_t field_len )
+{
+	char buf[ 64 ];
+
+	if ( field_len < sizeof(buf) )
+	{
+		memcpy( buf, field, field_len );
+		buf[ field_len ] = 0;
+		return strtoll( buf, 0, 0 );
+	}
+
+	return strtoll( std::string( field, field_len ).c_str(), 0, 0 );
+}
+
+/*
+ * the string aggregators keep their state in a blob, allocated in the blob_arena passed to them
+ * minstr, maxstr: the length of the string (uint32_t), then its data
+ * top20: the length of the blob (uint32_t), the number of values (1 byte), then the values, each as its length
+ *  (varint) and data ; when a value does not fit in the block, the blob is moved to a bigger one
+ */
+
+enum {
+	TOP_HEAD = 5,
+	TOP_MAX = 20,
+};
+
+// store n at p as a varint (7 bits per byte, low bits first), return the number of bytes used
+static unsigned put_varint( char *p, size_t n )
 {
+	unsigned i = 0;
+	for ( ; n >= 0x80 ; n >>= 7 )
+		p[ i++ ] = (char)( n | 0x80 );
+	p[ i++ ] = (char)n;
+
+	return i;
+}
+
+static const char *get_varint( const char *p, size_t *n )
+{
+	*n = 0;
+	for ( unsigned shift = 0 ; ; shift += 7 )
+	{
+		unsigned char c = *p++;
+		*n |= (size_t)( c & 0x7f ) << shift;
+		if ( !( c & 0x80 ) )
+			return p;
+	}
+}
+
+static void top20_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	uint32_t used = TOP_HEAD;
+
 	if ( first )
-		ptr->vec_str = new std::vector< std::string >;
+	{
+		ptr->blob = (char *)mem->alloc( TOP_HEAD );
+		memcpy( ptr->blob, &used, sizeof(used) );
+		ptr->blob[ 4 ] = 0;
+	}
+	else
+		memcpy( &used, ptr->blob, sizeof(used) );
 
-	if ( ptr->vec_str->size() >= 20 )
+	unsigned char count = ptr->blob[ 4 ];
+	if ( count >= TOP_MAX )
 		return;
 
-	for ( unsigned i = 0 ; i < ptr->vec_str->size() ; ++i )
-		if ( (*ptr->vec_str)[ i ] == *field )
+	for ( const char *p = ptr->blob + TOP_HEAD ; p < ptr->blob + used ; )
+	{
+		size_t len;
+		p = get_varint( p, &len );
+		if ( len == field_len && !memcmp( p, field, len ) )
 			return;
+		p += len;
+	}
+
+	char tmp[ 10 ];
+	unsigned vlen = put_varint( tmp, field_len );
+	size_t need = used + vlen + field_len;
+
+	if ( need > blob_arena::block_size( used ) )
+	{
+		char *blob = (char *)mem->alloc( need );
+		memcpy( blob, ptr->blob, used );
+		mem->free( ptr->blob, used );
+		ptr->blob = blob;
+	}
 
-	ptr->vec_str->push_back( *field );
+	memcpy( ptr->blob + used, tmp, vlen );
+	memcpy( ptr->blob + used + vlen, field, field_len );
+	used = need;
+	memcpy( ptr->blob, &used, sizeof(used) );
+	ptr->blob[ 4 ] = count + 1;
 }
 
-static void top20_merge( u_data *ptr, const std::string *field, int first )
+static void top20_merge( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
 {
-	size_t last = 0, next = field->find( ',' );
-	while ( next != std::string::npos )
+	const char *end = field + field_len;
+	const char *next;
+	while ( ( next = (const char *)memchr( field, ',', end - field ) ) )
 	{
-		const std::string &tmp = field->substr( last, next-last );
-		top20_aggreg( ptr, &tmp, first );
+		top20_aggreg( ptr, field, next - field, first, mem );
 		first = 0;
-		last = next + 1;
-		next = field->find( ',', last );
+		field = next + 1;
 	}
 
-	const std::string &tmp = field->substr( last );
-	top20_aggreg( ptr, &tmp, first );
+	top20_aggreg( ptr, field, end - field, first, mem );
 }
 
 static void top_out( u_data *ptr, output_buffer &out )
 {
-	std::string tmp;
+	uint32_t used;
+	memcpy( &used, ptr->blob, sizeof(used) );
+	unsigned char count = ptr->blob[ 4 ];
+
+	const char *p = ptr->blob + TOP_HEAD;
+	size_t len = 0;
+	if ( count == 1 )
+		get_varint( p, &len );
 
-	for ( unsigned i = 0 ; i < ptr->vec_str->size() ; ++i )
+	// the values joined with ',', as a csv field (nothing if empty)
+	if ( count > 1 || ( count == 1 && len > 0 ) )
 	{
-		if ( i > 0 )
-			tmp.push_back( ',' );
-		tmp.append( (*ptr->vec_str)[ i ] );
+		out.append( '"' );
+		for ( unsigned i = 0 ; p < ptr->blob + used ; ++i )
+		{
+			if ( i > 0 )
+				out.append( ',' );
+			p = get_varint( p, &len );
+			out.append_escaped_data( p, len );
+			p += len;
+		}
+		out.append( '"' );
 	}
-
-	out.append( csv_reader::escape_csv_string( tmp ) );
-
-	delete ptr->vec_str;
-	ptr->vec_str = NULL;
 }
 
-static void min_aggreg( u_data *ptr, const std::string *field, int first )
+static void min_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
 {
-	long long val = strtoll( field->c_str(), 0, 0 );
+	(void)mem;
+	long long val = field_ll( field, field_len );
 	if ( first || val < ptr->ll )
 		ptr->ll = val;
 }
 
-static void max_aggreg( u_data *ptr, const std::string *field, int first )
+static void max_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
 {
-	long long val = strtoll( field->c_str(), 0, 0 );
+	(void)mem;
+	long long val = field_ll( field, field_len );
 	if ( first || val > ptr->ll )
 		ptr->ll = val;
 }
 
 static void str_out( u_data *ptr, output_buffer &out )
 {
-	out.append( csv_reader::escape_csv_string( *ptr->str ) );
-
-	delete ptr->str;
-	ptr->str = NULL;
+	uint32_t len;
+	memcpy( &len, ptr->blob, sizeof(len) );
+	out.append_escaped( ptr->blob + sizeof(len), len );
 }
 
-static void minstr_aggreg( u_data *ptr, const std::string *field, int first )
+// replace the string of a minstr/maxstr blob
+static void str_set( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
 {
+	uint32_t len = field_len;
+
 	if ( first )
-		ptr->str = new std::string;
+		ptr->blob = (char *)mem->alloc( sizeof(len) + len );
+	else
+	{
+		uint32_t old_len;
+		memcpy( &old_len, ptr->blob, sizeof(old_len) );
+		if ( blob_arena::block_size( sizeof(len) + len ) != blob_arena::block_size( sizeof(len) + old_len ) )
+		{
+			mem->free( ptr->blob, sizeof(old_len) + old_len );
+			ptr->blob = (char *)mem->alloc( sizeof(len) + len );
+		}
+	}
 
-	if ( first || *field < *ptr->str )
-		*ptr->str = *field;
+	memcpy( ptr->blob, &len, sizeof(len) );
+	memcpy( ptr->blob + sizeof(len), field, len );
 }
 
-static void maxstr_aggreg( u_data *ptr, const std::string *field, int first )
+// compare field with the string of a minstr/maxstr blob, as std::string::compare
+static int str_compare( const u_data *ptr, const char *field, size_t field_len )
 {
-	if ( first )
-		ptr->str = new std::string;
+	uint32_t len;
+	memcpy( &len, ptr->blob, sizeof(len) );
+
+	int r = memcmp( ptr->blob + sizeof(len), field, ( len < field_len ? len : field_len ) );
+	if ( r )
+		return r;
 
-	if ( first || *field > *ptr->str )
-		*ptr->str = *field;
+	return ( len < field_len ? -1 : len > field_len ? 1 : 0 );
 }
 
-static void count_aggreg( u_data *ptr, const std::string *field, int first )
+static void minstr_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	if ( first || str_compare( ptr, field, field_len ) > 0 )
+		str_set( ptr, field, field_len, first, mem );
+}
+
+static void maxstr_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	if ( first || str_compare( ptr, field, field_len ) < 0 )
+		str_set( ptr, field, field_len, first, mem );
+}
+
+static void count_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
 {
 	(void)field;
+	(void)field_len;
+	(void)mem;
 	if ( first )
 		ptr->ll = 1;
 	else
 		++(ptr->ll);
 }
 
-static void count_merge( u_data *ptr, const std::string *field, int first )
+static void count_merge( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
 {
+	(void)mem;
 	if ( first )
 		ptr->ll = 0;
-	ptr->ll += strtoll( field->c_str(), 0, 0 );
+	ptr->ll += field_ll( field, field_len );
 }
 
 static void int_out( u_data *ptr, output_buffer &out )
 {
-	char buf[16];
-	unsigned buf_sz = snprintf( buf, sizeof(buf), "%lld", ptr->ll );
-	if ( buf_sz > sizeof(buf) )
-		buf_sz = sizeof(buf);
-	out.append( buf, buf_sz );
+	out.append_int( ptr->ll );
+}
+
+/*
+ * the numeric aggregators parse the fields with csv_parse_number(), fields that are not numbers are ignored
+ * their state may take several consecutive u_data (see aggreg_descriptor::slots):
+ * sum: integer sum (ll), sum of the other numbers (d) ; integers are added exactly, until the integer sum overflows
+ * avg: count (ll), then the two slots of sum
+ * variance, stddev: count (ll), mean (d), sum of the squared deviations from the mean (d), updated with Welford's method
+ * fmin, fmax: the value (d), NaN until a number is found
+ * avg, variance and stddev cannot be merged from their final value: with -p, they output their state as numbers
+ * separated by ':' instead (eg "count:sum"), and every number is output with enough digits to be read back exactly
+ */
+
+enum {
+	FLOAT_DIGITS = 15,	// significant digits of the final values
+	FLOAT_EXACT_DIGITS = 17,	// significant digits of the partial values (-p), enough to round trip
+};
+
+// parse field as a number, return false if it is not one
+static bool field_double( const char *field, size_t field_len, double *v )
+{
+	long long i;
+	int kind = ( field ? csv_parse_number( field, field_len, &i, v ) : CSV_NUM_NONE );
+	if ( kind == CSV_NUM_INT )
+		*v = (double)i;
+
+	return kind != CSV_NUM_NONE;
+}
+
+static void double_out( double v, int digits, output_buffer &out )
+{
+	char buf[ 32 ];
+	int len = snprintf( buf, sizeof(buf), "%.*g", digits, v );
+	out.append( buf, len );
+}
+
+// add field to the state of sum at ptr, return false if field is not a number
+static bool sum_add( u_data *ptr, const char *field, size_t field_len )
+{
+	long long i, sum;
+	double d;
+	switch ( field ? csv_parse_number( field, field_len, &i, &d ) : CSV_NUM_NONE )
+	{
+	case CSV_NUM_INT:
+		if ( __builtin_add_overflow( ptr[ 0 ].ll, i, &sum ) )
+			ptr[ 1 ].d += (double)i;
+		else
+			ptr[ 0 ].ll = sum;
+		return true;
+
+	case CSV_NUM_FLOAT:
+		ptr[ 1 ].d += d;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static void sum_write( u_data *ptr, int digits, output_buffer &out )
+{
+	if ( ptr[ 1 ].d == 0 )
+		out.append_int( ptr[ 0 ].ll );
+	else
+		double_out( (double)ptr[ 0 ].ll + ptr[ 1 ].d, digits, out );
+}
+
+static void sum_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	(void)mem;
+	if ( first )
+	{
+		ptr[ 0 ].ll = 0;
+		ptr[ 1 ].d = 0;
+	}
+	sum_add( ptr, field, field_len );
+}
+
+static void sum_out( u_data *ptr, output_buffer &out )
+{
+	sum_write( ptr, FLOAT_DIGITS, out );
+}
+
+static void sum_partial_out( u_data *ptr, output_buffer &out )
+{
+	sum_write( ptr, FLOAT_EXACT_DIGITS, out );
+}
+
+// split the partial state of an aggregator (see -p) in n numbers, return false if there is another number of them
+static bool split_partial( const char *field, size_t field_len, const char **f, size_t *f_len, unsigned n )
+{
+	const char *end = ( field ? field + field_len : NULL );
+	for ( unsigned i = 0 ; i < n ; ++i )
+	{
+		const char *next = ( field ? (const char *)memchr( field, ':', end - field ) : NULL );
+		if ( ( i < n - 1 ) != ( next != NULL ) )
+			return false;
+
+		f[ i ] = field;
+		f_len[ i ] = ( next ? next : end ) - field;
+		if ( next )
+			field = next + 1;
+	}
+
+	return true;
+}
+
+static void avg_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	(void)mem;
+	if ( first )
+	{
+		ptr[ 0 ].ll = 0;
+		ptr[ 1 ].ll = 0;
+		ptr[ 2 ].d = 0;
+	}
+	if ( sum_add( ptr + 1, field, field_len ) )
+		++ptr[ 0 ].ll;
+}
+
+static void avg_merge( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	(void)mem;
+	if ( first )
+	{
+		ptr[ 0 ].ll = 0;
+		ptr[ 1 ].ll = 0;
+		ptr[ 2 ].d = 0;
+	}
+
+	const char *f[ 2 ];
+	size_t f_len[ 2 ];
+	if ( split_partial( field, field_len, f, f_len, 2 ) && sum_add( ptr + 1, f[ 1 ], f_len[ 1 ] ) )
+		ptr[ 0 ].ll += field_ll( f[ 0 ], f_len[ 0 ] );
+}
+
+static void avg_out( u_data *ptr, output_buffer &out )
+{
+	if ( ptr[ 0 ].ll > 0 )
+		double_out( ( (double)ptr[ 1 ].ll + ptr[ 2 ].d ) / ptr[ 0 ].ll, FLOAT_DIGITS, out );
+}
+
+static void avg_partial_out( u_data *ptr, output_buffer &out )
+{
+	out.append_int( ptr[ 0 ].ll );
+	out.append( ':' );
+	sum_write( ptr + 1, FLOAT_EXACT_DIGITS, out );
+}
+
+static void variance_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	(void)mem;
+	if ( first )
+	{
+		ptr[ 0 ].ll = 0;
+		ptr[ 1 ].d = 0;
+		ptr[ 2 ].d = 0;
+	}
+
+	double v;
+	if ( !field_double( field, field_len, &v ) )
+		return;
+
+	double delta = v - ptr[ 1 ].d;
+	++ptr[ 0 ].ll;
+	ptr[ 1 ].d += delta / ptr[ 0 ].ll;
+	ptr[ 2 ].d += delta * ( v - ptr[ 1 ].d );
+}
+
+// combine the moments of two sets of values (Chan et al.)
+static void variance_merge( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	(void)mem;
+	if ( first )
+	{
+		ptr[ 0 ].ll = 0;
+		ptr[ 1 ].d = 0;
+		ptr[ 2 ].d = 0;
+	}
+
+	const char *f[ 3 ];
+	size_t f_len[ 3 ];
+	double mean, m2;
+	if ( !split_partial( field, field_len, f, f_len, 3 ) || !field_double( f[ 1 ], f_len[ 1 ], &mean ) || !field_double( f[ 2 ], f_len[ 2 ], &m2 ) )
+		return;
+
+	long long n = field_ll( f[ 0 ], f_len[ 0 ] );
+	if ( n <= 0 )
+		return;
+
+	long long total = ptr[ 0 ].ll + n;
+	double delta = mean - ptr[ 1 ].d;
+	ptr[ 1 ].d += delta * n / total;
+	ptr[ 2 ].d += m2 + delta * delta * ptr[ 0 ].ll * n / total;
+	ptr[ 0 ].ll = total;
+}
+
+// sample variance
+static void variance_out( u_data *ptr, output_buffer &out )
+{
+	if ( ptr[ 0 ].ll > 1 )
+		double_out( ptr[ 2 ].d / ( ptr[ 0 ].ll - 1 ), FLOAT_DIGITS, out );
+}
+
+static void stddev_out( u_data *ptr, output_buffer &out )
+{
+	if ( ptr[ 0 ].ll > 1 )
+		double_out( sqrt( ptr[ 2 ].d / ( ptr[ 0 ].ll - 1 ) ), FLOAT_DIGITS, out );
+}
+
+static void variance_partial_out( u_data *ptr, output_buffer &out )
+{
+	out.append_int( ptr[ 0 ].ll );
+	out.append( ':' );
+	double_out( ptr[ 1 ].d, FLOAT_EXACT_DIGITS, out );
+	out.append( ':' );
+	double_out( ptr[ 2 ].d, FLOAT_EXACT_DIGITS, out );
+}
+
+static void fmin_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	(void)mem;
+	if ( first )
+		ptr->d = NAN;
+
+	double v;
+	if ( field_double( field, field_len, &v ) && !( v >= ptr->d ) )
+		ptr->d = v;
+}
+
+static void fmax_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	(void)mem;
+	if ( first )
+		ptr->d = NAN;
+
+	double v;
+	if ( field_double( field, field_len, &v ) && !( v <= ptr->d ) )
+		ptr->d = v;
+}
+
+static void float_out( u_data *ptr, output_buffer &out )
+{
+	if ( ptr->d == ptr->d )
+		double_out( ptr->d, FLOAT_DIGITS, out );
+}
+
+static void float_partial_out( u_data *ptr, output_buffer &out )
+{
+	if ( ptr->d == ptr->d )
+		double_out( ptr->d, FLOAT_EXACT_DIGITS, out );
+}
+
+/*
+ * count_distinct: HyperLogLog++ sketch of the values (see hyperloglog.h), the blob (blob) and number of entries (ll)
+ * with -p, the sketch is output in base64:
+ *  sparse: 's', then the entries as varints, each minus the previous one, in base64
+ *  dense: 'd', then each register (< 64) as one base64 digit
+ */
+
+static const char base64_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// value of a base64 digit, -1 if c is not one
+static int base64_value( char c )
+{
+	if ( c >= 'A' && c <= 'Z' )
+		return c - 'A';
+	if ( c >= 'a' && c <= 'z' )
+		return c - 'a' + 26;
+	if ( c >= '0' && c <= '9' )
+		return c - '0' + 52;
+	if ( c == '+' )
+		return 62;
+	if ( c == '/' )
+		return 63;
+	return -1;
+}
+
+static void base64_out( const unsigned char *data, size_t len, output_buffer &out )
+{
+	for ( size_t i = 0 ; i < len ; i += 3 )
+	{
+		uint32_t v = data[ i ] << 16;
+		if ( i + 1 < len )
+			v |= data[ i + 1 ] << 8;
+		if ( i + 2 < len )
+			v |= data[ i + 2 ];
+
+		out.append( base64_digits[ v >> 18 ] );
+		out.append( base64_digits[ ( v >> 12 ) & 63 ] );
+		out.append( i + 1 < len ? base64_digits[ ( v >> 6 ) & 63 ] : '=' );
+		out.append( i + 2 < len ? base64_digits[ v & 63 ] : '=' );
+	}
+}
+
+// decode base64 data, return false on an invalid digit
+static bool base64_decode( const char *s, size_t len, std::string &data )
+{
+	uint32_t v = 0;
+	unsigned bits = 0;
+
+	for ( size_t i = 0 ; i < len && s[ i ] != '=' ; ++i )
+	{
+		int d = base64_value( s[ i ] );
+		if ( d < 0 )
+			return false;
+
+		v = v << 6 | d;
+		bits += 6;
+		if ( bits >= 8 )
+		{
+			bits -= 8;
+			data.push_back( (char)( v >> bits ) );
+		}
+	}
+
+	return true;
+}
+
+static void count_distinct_aggreg( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	if ( first )
+	{
+		ptr[ 0 ].blob = NULL;
+		ptr[ 1 ].ll = 0;
+	}
+
+	if ( field )
+		hll_add_entry( &ptr[ 0 ].blob, &ptr[ 1 ].ll, hll_entry( murmur3_64( field, field_len ) ), mem );
+}
+
+static void count_distinct_merge( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem )
+{
+	if ( first )
+	{
+		ptr[ 0 ].blob = NULL;
+		ptr[ 1 ].ll = 0;
+	}
+
+	if ( field_len == 1 + HLL_M && field[ 0 ] == 'd' )
+	{
+		uint8_t regs[ HLL_M ];
+		for ( unsigned i = 0 ; i < HLL_M ; ++i )
+		{
+			int d = base64_value( field[ 1 + i ] );
+			if ( d < 0 )
+				return;
+			regs[ i ] = d;
+		}
+
+		hll_add_registers( &ptr[ 0 ].blob, &ptr[ 1 ].ll, regs, mem );
+	}
+	else if ( field_len > 0 && field[ 0 ] == 's' )
+	{
+		std::string data;
+		if ( !base64_decode( field + 1, field_len - 1, data ) || ( data.size() && data[ data.size() - 1 ] & 0x80 ) )
+			return;
+
+		size_t e = 0;
+		for ( const char *p = data.data() ; p < data.data() + data.size() ; )
+		{
+			size_t delta;
+			p = get_varint( p, &delta );
+			e += delta;
+			hll_add_entry( &ptr[ 0 ].blob, &ptr[ 1 ].ll, (uint32_t)e, mem );
+		}
+	}
+}
+
+static void count_distinct_out( u_data *ptr, output_buffer &out )
+{
+	out.append_uint( (unsigned long long)( hll_count( ptr[ 0 ].blob, ptr[ 1 ].ll ) + 0.5 ) );
+}
+
+static void count_distinct_partial_out( u_data *ptr, output_buffer &out )
+{
+	if ( ptr[ 1 ].ll == HLL_DENSE )
+	{
+		out.append( 'd' );
+		for ( unsigned i = 0 ; i < HLL_M ; ++i )
+			out.append( base64_digits[ (uint8_t)ptr[ 0 ].blob[ i ] ] );
+		return;
+	}
+
+	std::string data;
+	const uint32_t *e = (const uint32_t *)ptr[ 0 ].blob;
+	uint32_t prev = 0;
+	for ( long long i = 0 ; i < ptr[ 1 ].ll ; ++i )
+	{
+		char tmp[ 10 ];
+		data.append( tmp, put_varint( tmp, e[ i ] - prev ) );
+		prev = e[ i ];
+	}
+
+	out.append( 's' );
+	base64_out( (const unsigned char *)data.data(), data.size(), out );
 }
 
 
@@ -183,14 +692,19 @@ static void int_out( u_data *ptr, output_buffer &out )
 struct aggreg_descriptor {
 	// aggregator name, used in config/help messages
 	const char *name;
-	// called during aggregation, ptr is the same as for alloc(), field is the unescaped csv field value, first = 1 if field is the 1st entry to be aggregated here
-	void (*aggreg)( u_data *ptr, const std::string *field, int first );
+	// called during aggregation, ptr is the same as for alloc(), field is the unescaped csv field value (not nul-terminated, NULL if the output column has no input column), first = 1 if field is the 1st entry to be aggregated here
+	// field is only valid during the call: copy what must be kept, in blobs allocated from mem
+	void (*aggreg)( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem );
 	// called during merge, similar to aggreg, but field points to the result of a previous out(aggreg())
-	void (*merge)( u_data *ptr, const std::string *field, int first );
+	void (*merge)( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem );
 	// determine aggregation key, should append data to key. field is the raw csv field value, it is neither escaped nor unescaped.
 	void (*key)( char **k, size_t *klen );
 	// called when dumping aggregation results, ptr is the same as for alloc().
 	void (*out)( u_data *ptr, output_buffer &out );
+	// called instead of out with -p, to output a state that merge can read back exactly (NULL: same as out)
+	void (*partial_out)( u_data *ptr, output_buffer &out );
+	// number of consecutive u_data of the state, ptr points to the first one
+	unsigned slots;
 } aggreg_descriptors[] =
 {
 	{
@@ -199,6 +713,8 @@ struct aggreg_descriptor {
 		NULL,
 		str_key,
 		key_out,
+		NULL,
+		1,
 	},
 	{
 		"downcase",
@@ -206,6 +722,8 @@ struct aggreg_descriptor {
 		NULL,
 		downcase_key,
 		key_out,
+		NULL,
+		1,
 	},
 	{
 		"top20",
@@ -213,6 +731,8 @@ struct aggreg_descriptor {
 		top20_merge,
 		NULL,
 		top_out,
+		NULL,
+		1,
 	},
 	{
 		"min",
@@ -220,6 +740,8 @@ struct aggreg_descriptor {
 		min_aggreg,
 		NULL,
 		int_out,
+		NULL,
+		1,
 	},
 	{
 		"max",
@@ -227,6 +749,8 @@ struct aggreg_descriptor {
 		max_aggreg,
 		NULL,
 		int_out,
+		NULL,
+		1,
 	},
 	{
 		"minstr",
@@ -234,6 +758,8 @@ struct aggreg_descriptor {
 		minstr_aggreg,
 		NULL,
 		str_out,
+		NULL,
+		1,
 	},
 	{
 		"maxstr",
@@ -241,6 +767,8 @@ struct aggreg_descriptor {
 		maxstr_aggreg,
 		NULL,
 		str_out,
+		NULL,
+		1,
 	},
 	{
 		"count",
@@ -248,6 +776,71 @@ struct aggreg_descriptor {
 		count_merge,
 		NULL,
 		int_out,
+		NULL,
+		1,
+	},
+	{
+		"sum",
+		sum_aggreg,
+		sum_aggreg,
+		NULL,
+		sum_out,
+		sum_partial_out,
+		2,
+	},
+	{
+		"avg",
+		avg_aggreg,
+		avg_merge,
+		NULL,
+		avg_out,
+		avg_partial_out,
+		3,
+	},
+	{
+		"variance",
+		variance_aggreg,
+		variance_merge,
+		NULL,
+		variance_out,
+		variance_partial_out,
+		3,
+	},
+	{
+		"stddev",
+		variance_aggreg,
+		variance_merge,
+		NULL,
+		stddev_out,
+		variance_partial_out,
+		3,
+	},
+	{
+		"fmin",
+		fmin_aggreg,
+		fmin_aggreg,
+		NULL,
+		float_out,
+		float_partial_out,
+		1,
+	},
+	{
+		"fmax",
+		fmax_aggreg,
+		fmax_aggreg,
+		NULL,
+		float_out,
+		float_partial_out,
+		1,
+	},
+	{
+		"count_distinct",
+		count_distinct_aggreg,
+		count_distinct_merge,
+		NULL,
+		count_distinct_out,
+		count_distinct_partial_out,
+		2,
 	}
 };
 
@@ -256,33 +849,87 @@ struct aggreg_descriptor {
 class csv_aggreg
 {
 private:
-	// allocator for u_data & keys
-	mmap_alloc memalloc;
-
 	// csv reader line_max
 	unsigned line_max;
 
+	// csv reader input buffer size
+	unsigned block_size;
+
+	// csv reader threads
+	unsigned threads;
+
+	// temporary files directory for the aggregated data store (empty: in memory)
+	std::string bigtmp_directory;
+
 	// describe one output (aggregated) column
 	struct aggreg_col {
 		// output column name
 		std::string outname;
 		// input column name (may be empty)
 		std::string colname;
-		// index into the aggregated u_data * blob for this column ( = index of the entry in conf[] )
+		// index of the first u_data of this column in the aggregated u_data * blob (some aggregators use several)
 		unsigned aggreg_idx;
-		// index of the input column used for this output column (may change for each input file)
-		int input_col_idx;
 		// pointer to the aggregation functions
 		struct aggreg_descriptor *aggregator;
 
-		explicit aggreg_col() : outname(), colname(), aggreg_idx(0), input_col_idx(-1), aggregator(NULL) {}
+		explicit aggreg_col() : outname(), colname(), aggreg_idx(0), aggregator(NULL) {}
 	};
 
 	// aggregation configuration (list of output columns)
 	std::vector< struct aggreg_col > conf;
 
-	// aggregated data store
-	page_tree u_data_aggreg;
+	// number of u_data of an aggregated row
+	unsigned nslots;
+
+	// inputs are outputs of csv-aggreg
+	bool merge_mode;
+
+	// store the aggregated data in swiss_tables instead of page_trees
+	bool hash_store;
+
+	/*
+	 * aggregated data store, split in partitions owned by one thread each (see aggregate())
+	 * a row goes to the partition selected by the high bits of its key hash, so that partition n holds lower hashes
+	 * than partition n+1, and the partitions dumped in order give the same output as a single page_tree
+	 */
+	struct partition {
+		// allocator for keys
+		mmap_alloc memalloc;
+		// allocator for the aggregator states
+		blob_arena blobs;
+		// u_data of the keys, in one of the stores (see hash_store)
+		page_tree u_data_aggreg;
+		swiss_table u_data_table;
+		// batches of rows routed to this partition, waiting for its thread
+		std::deque< std::string * > queue;
+
+		explicit partition( const std::string &dir ) : memalloc( dir ), blobs( dir ), u_data_aggreg( dir ), u_data_table( dir ), queue() {}
+	};
+	std::vector< partition * > parts;
+
+	enum {
+		BATCH_SIZE = 64*1024,	// routed rows are sent to a partition by batches of that many bytes
+		QUEUE_MAX = 16,	// batches waiting per partition before the routing threads wait
+	};
+
+	// state of a thread reading inputs: rows being routed to each partition
+	struct aggreg_worker {
+		unsigned id;	// index of the partition owned by the thread
+		std::vector< std::string * > batch;
+	};
+
+	// threads: inputs left to read, partition queues
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::vector< const char * > inputs;
+	unsigned next_input;
+	unsigned workers_done;
+	bool go;	// set when parts is ready
+
+	struct thread_arg {
+		csv_aggreg *self;
+		aggreg_worker w;
+	};
 
 	// find an aggregator struct by name (eg "count", "min"...)
 	struct aggreg_descriptor *find_aggregator( const std::string &name )
@@ -302,167 +949,497 @@ private:
 		return ret;
 	}
 
-	// create a csv_reader for aggregation, read headerline, setup caches from aggreg_conf
-	csv_reader *start_reader_aggreg( const char *filename,
-			std::vector< std::vector< struct aggreg_col * > > &inv_conf,
-			std::vector< struct aggreg_col * > &inv_conf_other )
+	// create a csv_reader for aggregation, read headerline
+	// populate input_idx with the input column index of each output column (-1 if none), ncols with the number of
+	// input columns
+	csv_reader *start_reader_aggreg( const char *filename, const unsigned reader_threads, std::vector< int > &input_idx, unsigned *ncols )
 	{
 		std::vector< std::string > *headers;
-		csv_reader *reader = new csv_reader( filename, ',', '"', line_max );
+		csv_reader *reader = new csv_reader( filename, ',', '"', line_max, block_size, reader_threads );
+
+		if ( reader->failed_to_open() )
+			goto fail;
+
+		if ( !reader->fetch_line() )
+			goto fail;
+
+		headers = reader->parse_line();
+		*ncols = headers->size();
+
+		input_idx.assign( conf.size(), -1 );
+		for ( unsigned i_c = 0 ; i_c < conf.size() ; ++i_c )
+		{
+			for ( unsigned i_h = 0 ; i_h < headers->size() ; ++i_h )
+				if ( str_downcase( conf[ i_c ].colname ) == str_downcase( headers->at( i_h ) ) )
+					input_idx[ i_c ] = i_h;
+
+			if ( input_idx[ i_c ] == -1 && conf[ i_c ].colname.size() )
+			{
+				std::cerr << "Column not found: " << conf[ i_c ].colname << ", skipping file" << std::endl;
+				delete headers;
+				goto fail;
+			}
+		}
+
+		delete headers;
+
+		reader->fetch_line();
+
+		if ( reader->eos() )
+			goto fail;
+
+		return reader;
+
+	fail:
+		delete reader;
+		return NULL;
+	}
+
+	// create a csv_reader for merging, ensure columns match
+	// input_idx and ncols as for start_reader_aggreg()
+	csv_reader *start_reader_merge( const char *filename, const unsigned reader_threads, std::vector< int > &input_idx, unsigned *ncols )
+	{
+		std::vector< std::string > *headers = NULL;
+		csv_reader *reader = new csv_reader( filename, ',', '"', line_max, block_size, reader_threads );
 
 		if ( reader->failed_to_open() )
 			goto fail;
 
-		if ( !reader->fetch_line() )
-			goto fail;
+		if ( !reader->fetch_line() )
+			goto fail;
+
+		headers = reader->parse_line();
+
+		if ( headers->size() != conf.size() )
+		{
+			std::cerr << "Merge: column count differs, skipping file" << std::endl;
+			goto fail;
+		}
+
+		for ( unsigned i = 0 ; i < conf.size() ; ++i )
+			if ( str_downcase( conf[ i ].outname ) != str_downcase( headers->at( i ) ) )
+			{
+				std::cerr << "Merge: columns do not match (" << headers->at( i ) << " != " << conf[ i ].colname << "), skipping file" << std::endl;
+				goto fail;
+			}
+
+		reader->fetch_line();
+
+		if ( reader->eos() )
+			goto fail;
+
+		delete headers;
+
+		input_idx.resize( conf.size() );
+		for ( unsigned i = 0 ; i < conf.size() ; ++i )
+			input_idx[ i ] = i;
+		*ncols = conf.size();
+
+		return reader;
+
+	fail:
+		if ( headers )
+			delete headers;
+		delete reader;
+		return NULL;
+	}
+
+
+	// return true if the keys of p are the key columns of val
+	bool key_match( const u_data *p, const char * const *val, const size_t *val_len )
+	{
+		for  ( unsigned i = 0 ; i < conf.size() ; ++i )
+			if ( conf[ i ].aggregator->key )
+			{
+				const char *key = p[ conf[ i ].aggreg_idx ].key;
+				size_t slen = strlen( key );
+				if ( slen != val_len[ i ] || memcmp( key, val[ i ], slen ) )
+					return false;
+			}
+
+		return true;
+	}
+
+	/*
+	 * return the pointer for a given set of keys in a partition, allocate it if necessary
+	 * val holds the value of each output column, only the key columns are used
+	 * sets *first = 1 if a new buffer was allocated
+	 * copies keys bytes to the partition memalloc
+	 */
+	u_data *aggreg_find_or_create( partition *pt, const uint64_t hash, const char * const *val, const size_t *val_len, int *first )
+	{
+		u_data *p;
+
+		/* check for collisions */
+		if ( hash_store )
+		{
+			swiss_table::iter iter;
+			pt->u_data_table.iter_init_hash( hash, &iter );
+			while ( ( p = (u_data *)pt->u_data_table.iter_next_hash( hash, &iter ) ) )
+				if ( key_match( p, val, val_len ) )
+					return p;
+		}
+		else
+		{
+			uint16_t iter[8];
+			pt->u_data_aggreg.iter_init_hash( hash, iter, 8 );
+			while ( ( p = (u_data *)pt->u_data_aggreg.iter_next_hash( hash, iter ) ) )
+				if ( key_match( p, val, val_len ) )
+					return p;
+		}
+
+		/* create new entry */
+		*first = 1;
+
+		if ( hash_store )
+			p = (u_data *)pt->u_data_table.insert( hash );
+		else
+			p = (u_data *)pt->u_data_aggreg.insert( hash );
+
+		// copy keys
+		for ( unsigned i = 0 ; i < conf.size() ; ++i )
+			if ( conf[ i ].aggregator->key )
+			{
+				char *ptr = (char *)pt->memalloc.alloc( val_len[ i ] + 1, 1 );
+				if ( !ptr )
+					throw std::bad_alloc();
+
+				memcpy( ptr, val[ i ], val_len[ i ] );
+				ptr[ val_len[ i ] ] = 0;
+				p[ conf[ i ].aggreg_idx ].key = ptr;
+			}
+
+		return p;
+	}
+
+	// aggregate (or merge) a row in a partition
+	void aggreg_row( partition *pt, const uint64_t hash, const char * const *val, const size_t *val_len )
+	{
+		int first = 0;
+		u_data *p = aggreg_find_or_create( pt, hash, val, val_len, &first );
+
+		for ( unsigned i = 0 ; i < conf.size() ; ++i )
+		{
+			void (*fn)( u_data *ptr, const char *field, size_t field_len, int first, blob_arena *mem ) =
+				( merge_mode ? conf[ i ].aggregator->merge : conf[ i ].aggregator->aggreg );
+			if ( fn )
+				fn( p + conf[ i ].aggreg_idx, val[ i ], val_len[ i ], first, &pt->blobs );
+		}
+	}
+
+	// store a row, given the value of each output column: the key for key columns, the unescaped input field for
+	// the others, NULL if there is no input column
+	// without threads, the row is aggregated in place ; otherwise it is appended to the batch of its partition:
+	// hash, then for each column its length (~0U for NULL) and data
+	void store_row( aggreg_worker *w, const char * const *val, const size_t *val_len )
+	{
+		uint64_t hash = 0;
+		for ( unsigned i = 0 ; i < conf.size() ; ++i )
+			if ( conf[ i ].aggregator->key )
+				hash = murmur3_64( val[ i ], val_len[ i ], hash );
+
+		if ( !w )
+		{
+			aggreg_row( parts[ 0 ], hash, val, val_len );
+			return;
+		}
+
+		unsigned part = ( ( hash >> 32 ) * parts.size() ) >> 32;
+		std::string *&b = w->batch[ part ];
+		if ( !b )
+		{
+			b = new std::string;
+			b->reserve( BATCH_SIZE + 1024 );
+		}
+
+		b->append( (const char *)&hash, sizeof(hash) );
+		for ( unsigned i = 0 ; i < conf.size() ; ++i )
+		{
+			uint32_t len = ( val[ i ] ? val_len[ i ] : ~0U );
+			b->append( (const char *)&len, sizeof(len) );
+			if ( val[ i ] )
+				b->append( val[ i ], val_len[ i ] );
+		}
+
+		if ( b->size() >= BATCH_SIZE )
+		{
+			push_batch( w, part, b );
+			b = NULL;
+		}
+	}
+
+	// aggregate the rows of a batch made by store_row()
+	void aggreg_batch( partition *pt, const std::string *b )
+	{
+		std::vector< const char * > val( conf.size() );
+		std::vector< size_t > val_len( conf.size() );
+		const char *ptr = b->data();
+		const char *end = ptr + b->size();
+
+		while ( ptr < end )
+		{
+			uint64_t hash;
+			memcpy( &hash, ptr, sizeof(hash) );
+			ptr += sizeof(hash);
+
+			for ( unsigned i = 0 ; i < conf.size() ; ++i )
+			{
+				uint32_t len;
+				memcpy( &len, ptr, sizeof(len) );
+				ptr += sizeof(len);
+
+				if ( len == ~0U )
+				{
+					val[ i ] = NULL;
+					val_len[ i ] = 0;
+				}
+				else
+				{
+					val[ i ] = ptr;
+					val_len[ i ] = len;
+					ptr += len;
+				}
+			}
+
+			aggreg_row( pt, hash, &val[ 0 ], &val_len[ 0 ] );
+		}
+	}
+
+	// with lock held: aggregate the batches queued for the partition of w
+	// return false if there was none
+	bool drain_queue( aggreg_worker *w )
+	{
+		partition *pt = parts[ w->id ];
+		if ( pt->queue.empty() )
+			return false;
+
+		while ( !pt->queue.empty() )
+		{
+			std::string *b = pt->queue.front();
+			pt->queue.pop_front();
+			pthread_cond_broadcast( &cond );
+			pthread_mutex_unlock( &lock );
+
+			aggreg_batch( pt, b );
+			delete b;
+
+			pthread_mutex_lock( &lock );
+		}
+
+		return true;
+	}
+
+	// queue a batch for partition part, then aggregate the batches queued for w
+	// while the queue is full, the batches of w are aggregated, so that the threads cannot all wait for each other
+	void push_batch( aggreg_worker *w, const unsigned part, std::string *b )
+	{
+		pthread_mutex_lock( &lock );
+		while ( parts[ part ]->queue.size() >= QUEUE_MAX )
+			if ( !drain_queue( w ) )
+				pthread_cond_wait( &cond, &lock );
+
+		parts[ part ]->queue.push_back( b );
+		pthread_cond_broadcast( &cond );
+
+		drain_queue( w );
+		pthread_mutex_unlock( &lock );
+	}
+
+	// read an input file, pass its rows to store_row()
+	void read_input( const char *filename, aggreg_worker *w, const unsigned reader_threads )
+	{
+		// input column of each output column, -1 if none
+		std::vector< int > input_idx;
+		unsigned ncols = 0;
+
+		csv_reader *reader;
+		if ( merge_mode )
+			reader = start_reader_merge( filename, reader_threads, input_idx, &ncols );
+		else
+			reader = start_reader_aggreg( filename, reader_threads, input_idx, &ncols );
+		if ( !reader )
+			return;
+
+		// unescaped input fields, NULL until unescaped for the current line
+		std::vector< char * > field( ncols );
+		std::vector< size_t > field_len( ncols );
+
+		// output column values for the current line
+		std::vector< char * > val( conf.size() );
+		std::vector< size_t > val_len( conf.size() );
+
+		// current line csv fields
+		char *line = NULL;
+		std::vector< unsigned > field_off( ncols );
+
+		do
+		{
+			// split line in csv fields
+			unsigned f_off = 0;
+			unsigned f_len = 0;
+			unsigned n_fields = 0;
+			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
+			{
+				field_off[ n_fields ] = f_off;
+				field_len[ n_fields ] = f_len;
+
+				// the extra fields are not used
+				if ( ++n_fields == ncols )
+				{
+					reader->skip_row( &line );
+					break;
+				}
+			}
 
-		headers = reader->parse_line();
+			if ( n_fields < ncols )
+			{
+				unsigned snap_sz = f_off + f_len;
+				if ( snap_sz > 32 )
+					snap_sz = 32;
+				std::cerr << "Bad field count, skipping line near " << std::string( line, snap_sz ) << std::endl;
 
-		// populate the invert lookup cache from the header line + conf
-		inv_conf.resize( headers->size() );
-		for ( unsigned i_c = 0 ; i_c < conf.size() ; ++i_c )
-		{
-			conf[ i_c ].input_col_idx = -1;
-			for ( unsigned i_h = 0 ; i_h < headers->size() ; ++i_h )
-				if ( str_downcase( conf[ i_c ].colname ) == str_downcase( headers->at( i_h ) ) )
+				continue;
+			}
+
+			// unescape the csv fields we're interested in, compute the keys
+			for ( unsigned i = 0 ; i < conf.size() ; ++i )
+			{
+				int fi = input_idx[ i ];
+				if ( fi == -1 )
 				{
-					conf[ i_c ].input_col_idx = i_h;
-					if ( conf[ i_c ].aggregator->aggreg )
-						inv_conf[ i_h ].push_back( &conf[ i_c ] );
+					val[ i ] = NULL;
+					val_len[ i ] = 0;
+					continue;
 				}
 
-			if ( conf[ i_c ].input_col_idx == -1 )
-			{
-				if ( conf[ i_c ].colname.size() )
+				if ( !field[ fi ] )
 				{
-					std::cerr << "Column not found: " << conf[ i_c ].colname << ", skipping file" << std::endl;
-					delete headers;
-					goto fail;
+					unsigned ul = field_len[ fi ];
+					field[ fi ] = reader->unescape_field( line + field_off[ fi ], &ul );
+					field_len[ fi ] = ul;
 				}
 
-				if ( conf[ i_c ].aggregator->aggreg )
-					inv_conf_other.push_back( &conf[ i_c ] );
-			}
-		}
+				val[ i ] = field[ fi ];
+				val_len[ i ] = field_len[ fi ];
 
-		delete headers;
+				if ( conf[ i ].aggregator->key )
+					conf[ i ].aggregator->key( &val[ i ], &val_len[ i ] );
+			}
 
-		reader->fetch_line();
+			store_row( w, &val[ 0 ], &val_len[ 0 ] );
 
-		if ( reader->eos() )
-			goto fail;
+			for ( unsigned i = 0 ; i < conf.size() ; ++i )
+				if ( input_idx[ i ] != -1 )
+					field[ input_idx[ i ] ] = NULL;
 
-		return reader;
+		} while ( reader->fetch_line() );
 
-	fail:
 		delete reader;
-		return NULL;
 	}
 
-	// create a csv_reader for merging, ensure columns match
-	csv_reader *start_reader_merge( const char *filename )
+	// thread main loop: read the inputs left, routing their rows, then aggregate the rows of the partition of w
+	// until all threads are done
+	void work( aggreg_worker *w )
 	{
-		std::vector< std::string > *headers = NULL;
-		csv_reader *reader = new csv_reader( filename, ',', '"', line_max );
-
-		if ( reader->failed_to_open() )
-			goto fail;
+		pthread_mutex_lock( &lock );
+		while ( !go )
+			pthread_cond_wait( &cond, &lock );
 
-		if ( !reader->fetch_line() )
-			goto fail;
+		w->batch.assign( parts.size(), NULL );
 
-		headers = reader->parse_line();
+		// with less inputs than threads, the readers may use threads to decompress
+		unsigned reader_threads = ( inputs.size() < parts.size() ? threads : 1 );
 
-		if ( headers->size() != conf.size() )
+		while ( next_input < inputs.size() )
 		{
-			std::cerr << "Merge: column count differs, skipping file" << std::endl;
-			goto fail;
-		}
+			const char *filename = inputs[ next_input++ ];
+			pthread_mutex_unlock( &lock );
 
-		for ( unsigned i = 0 ; i < conf.size() ; ++i )
-			if ( str_downcase( conf[ i ].outname ) != str_downcase( headers->at( i ) ) )
-			{
-				std::cerr << "Merge: columns do not match (" << headers->at( i ) << " != " << conf[ i ].colname << "), skipping file" << std::endl;
-				goto fail;
-			}
+			read_input( filename, w, reader_threads );
 
-		reader->fetch_line();
+			for ( unsigned i = 0 ; i < parts.size() ; ++i )
+				if ( w->batch[ i ] )
+				{
+					push_batch( w, i, w->batch[ i ] );
+					w->batch[ i ] = NULL;
+				}
 
-		if ( reader->eos() )
-			goto fail;
+			pthread_mutex_lock( &lock );
+		}
 
-		delete headers;
+		++workers_done;
+		pthread_cond_broadcast( &cond );
 
-		return reader;
+		for (;;)
+		{
+			if ( drain_queue( w ) )
+				continue;
+			if ( workers_done == parts.size() )
+				break;
+			pthread_cond_wait( &cond, &lock );
+		}
+		pthread_mutex_unlock( &lock );
+	}
 
-	fail:
-		if ( headers )
-			delete headers;
-		delete reader;
+	static void *worker_thread( void *arg )
+	{
+		thread_arg *t = (thread_arg *)arg;
+		t->self->work( &t->w );
 		return NULL;
 	}
 
-
-	/*
-	 * return the pointer for a given set of keys, allocate it if necessary
-	 * sets *first = 1 if a new buffer was allocated
-	 * copies keys bytes to memalloc
-	 */
-	u_data *aggreg_find_or_create( const std::vector< char * > key, const std::vector< size_t > key_len, int *first )
+	// partial: use the partial_out of the aggregators, see dump_output()
+	void dump_row( u_data *p, output_buffer &outbuf, const bool partial )
 	{
-		uint64_t hash = 0;
-		for ( unsigned i = 0 ; i < key.size() ; ++i )
-			if ( key[ i ] )
-				hash = murmur3_64( key[ i ], key_len[ i ], hash );
-
-		uint16_t iter[8];
-		u_data_aggreg.iter_init_hash( hash, iter, 8 );
-		u_data *p;
-		while ( ( p = (u_data *)u_data_aggreg.iter_next_hash( hash, iter ) ) )
+		for ( unsigned i = 0 ; i < conf.size() ; ++i )
 		{
-			/* check for collisions */
-			bool match = true;
-
-			for  ( unsigned i = 0 ; match && i < key.size() ; ++i )
-				if ( key[ i ] )
-				{
-					size_t slen = strlen( p[ i ].key );
-					if ( slen != key_len[ i ] || memcmp( p[ i ].key, key[ i ], slen ) )
-						match = false;
-				}
+			if ( i > 0 )
+				outbuf.append( ',' );
 
-			if ( match )
-				return p;
+			void (*out)( u_data *ptr, output_buffer &out ) = conf[ i ].aggregator->out;
+			if ( partial && conf[ i ].aggregator->partial_out )
+				out = conf[ i ].aggregator->partial_out;
+			if ( out )
+				out( p + conf[ i ].aggreg_idx, outbuf );
 		}
+		outbuf.append_nl();
+	}
 
-		/* create new entry */
-		*first = 1;
-
-		p = (u_data *)u_data_aggreg.insert( hash );
-
-		// copy keys
-		for ( unsigned i = 0 ; i < key.size() ; ++i )
-			if ( key[ i ] )
-			{
-				char *ptr = (char *)memalloc.alloc( key_len[ i ] + 1, 1 );
-				if ( !ptr )
-					throw std::bad_alloc();
-
-				memcpy( ptr, key[ i ], key_len[ i ] );
-				ptr[ key_len[ i ] ] = 0;
-				p[ i ].key = ptr;
-			}
-
-		return p;
+	void add_partition( )
+	{
+		partition *pt = new partition( bigtmp_directory );
+		if ( hash_store )
+			pt->u_data_table.set_value_size( nslots * sizeof(u_data) );
+		else
+			pt->u_data_aggreg.set_value_size( nslots * sizeof(u_data) );
+		parts.push_back( pt );
 	}
 
 
 public:
-	explicit csv_aggreg ( const std::string &bigtmp_directory = "", unsigned line_max = 64*1024 ) :
-		memalloc( bigtmp_directory ),
+	explicit csv_aggreg ( const std::string &bigtmp_directory = "", unsigned line_max = 64*1024, unsigned block_size = 4*1024*1024, unsigned threads = 1, bool hash_store = false ) :
 		line_max(line_max),
-		u_data_aggreg( bigtmp_directory )
+		block_size(block_size),
+		threads(threads),
+		bigtmp_directory(bigtmp_directory),
+		nslots(0),
+		merge_mode(false),
+		hash_store(hash_store),
+		next_input(0),
+		workers_done(0),
+		go(false)
+	{
+		pthread_mutex_init( &lock, NULL );
+		pthread_cond_init( &cond, NULL );
+	}
+
+	~csv_aggreg ( )
 	{
+		for ( unsigned i = 0 ; i < parts.size() ; ++i )
+			delete parts[ i ];
+
+		pthread_cond_destroy( &cond );
+		pthread_mutex_destroy( &lock );
 	}
 
 	// parse an aggregation descriptor string into self.conf
@@ -499,7 +1476,6 @@ public:
 				if ( parens == 1 )
 				{
 					col = new aggreg_col();
-					col->aggreg_idx = conf.size();
 
 					col->aggregator = find_aggregator( tmp );
 					if ( !col->aggregator ) {
@@ -543,7 +1519,6 @@ public:
 					// colname only, implicit str(colname)
 	implicit_str:
 					col = new aggreg_col();
-					col->aggreg_idx = conf.size();
 
 					if ( outname.size() )
 						col->outname = outname;
@@ -588,241 +1563,65 @@ public:
 			return 1;
 		}
 
-		u_data_aggreg.set_value_size( conf.size() * sizeof(u_data) );
-
-		return 0;
-	}
-
-
-	// read an input file, aggregate the data inside into the global aggregation structure
-	void aggregate( const char *filename )
-	{
-		// internal cache: maps input column indexes to a vector of output columns (NULL if input col is unused)
-		std::vector< std::vector< struct aggreg_col * > > inv_conf;
-		// points to aggreg_cols not listed in inv_conf (ie not linked to an input column)
-		std::vector< struct aggreg_col * > inv_conf_other;
-
-		csv_reader *reader = start_reader_aggreg( filename, inv_conf, inv_conf_other );
-		if ( !reader )
-			return;
-
-		// hold unescaped field values for the current line
-		std::vector< char * > field( inv_conf.size() );
-		std::vector< size_t > field_len( inv_conf.size() );
-
-		// hold unescaped key data for the current line
-		std::vector< char * > key( conf.size() );
-		std::vector< size_t > key_len( conf.size() );
-
-		// current line csv fields
-		char *line = NULL;
-		std::vector< unsigned > field_off( inv_conf.size() );
-
-		// hold pointers to string that were allocated for unescaping (unusual) ; to be freed at the end of the line
-		std::vector< std::string * > str_tofree( inv_conf.size() );
-
-		// maps input column -> output column index for keys
-		std::vector< int > key_idx( inv_conf.size(), -1 );
-		for ( unsigned i = 0 ; i < conf.size() ; ++i )
-			if ( conf[ i ].aggregator->key )
-				key_idx[ conf[ i ].input_col_idx ] = i;
-
-		do
+		nslots = 0;
+		for ( i = 0 ; i < conf.size() ; ++i )
 		{
-			// split line in csv fields
-			unsigned f_off = 0;
-			unsigned f_len = 0;
-			unsigned n_fields = 0;
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
-			{
-				if ( n_fields >= inv_conf.size() )
-					continue;
-
-				field_off[ n_fields ] = f_off;
-				field_len[ n_fields ] = f_len;
-
-				++n_fields;
-			}
-
-			if ( n_fields < inv_conf.size() )
-			{
-				unsigned snap_sz = f_off + f_len;
-				if ( snap_sz > 32 )
-					snap_sz = 32;
-				std::cerr << "Bad field count, skipping line near " << std::string( line, snap_sz ) << std::endl;
-
-				continue;
-			}
-
-			// unescape the csv fields we're interested in
-			for ( unsigned i = 0 ; i < n_fields ; ++i )
-			{
-				int ki = key_idx[ i ];
-
-				if ( ki != -1 || inv_conf[ i ].size() )
-				{
-					char *uf = line + field_off[ i ];
-					unsigned ul = field_len[ i ];
-					std::string *s = reader->unescape_csv_field( &uf, &ul );
-
-					if ( s )
-					{
-						str_tofree[ i ] = s;
-						uf = (char *)s->data();
-						ul = s->size();
-					}
-					field[ i ] = uf;
-					field_len[ i ] = ul;
-
-					if ( ki != -1 )
-					{
-						key[ ki ] = field[ i ];
-						key_len[ ki ] = field_len[ i ];
-
-						conf[ ki ].aggregator->key( &key[ ki ], &key_len[ ki ] );
-					}
-				}
-			}
-
-			// aggregate
-			int first = 0;
-			u_data *p = aggreg_find_or_create( key, key_len, &first );
-
-			for ( unsigned i = 0 ; i < n_fields ; ++i )
-			{
-				// TODO aggreg( fptr, flen )
-				if ( inv_conf[ i ].size() )
-				{
-					std::string str( field[ i ], field_len[ i ] );
-					for ( unsigned j = 0 ; j < inv_conf[ i ].size() ; ++j )
-					{
-						struct aggreg_col *a = inv_conf[ i ][ j ];
-						a->aggregator->aggreg( p + a->aggreg_idx, &str, first );
-					}
-				}
-
-				if ( str_tofree[ i ] )
-				{
-					delete str_tofree[ i ];
-					str_tofree[ i ] = NULL;
-				}
-			}
-
-			// aggregate output columns not in inv_conf (eg count())
-			for ( unsigned i = 0 ; i < inv_conf_other.size() ; ++i )
-			{
-				struct aggreg_col *a = inv_conf_other[ i ];
-				a->aggregator->aggreg( p + a->aggreg_idx, NULL, first );
-			}
-
-		} while ( reader->fetch_line() );
+			conf[ i ].aggreg_idx = nslots;
+			nslots += conf[ i ].aggregator->slots;
+		}
 
-		delete reader;
+		return 0;
 	}
 
 
-	// read already-aggregated data, integrate it into the global aggregated store (ie the reduce in map-reduce)
-	void merge( const char *filename )
+	// read the input files (stdin if there is none), aggregate their rows
+	// merge: the inputs are already-aggregated data, integrated into the aggregated store (ie the reduce in map-reduce)
+	// with threads > 1, each thread reads whole input files and routes their rows to the partitions, one per thread
+	void aggregate( const std::vector< const char * > &filenames, const bool merge )
 	{
-		csv_reader *reader = start_reader_merge( filename );
-		if ( !reader )
-			return;
-
-		// hold unescaped field values for the current line
-		std::vector< char * > field( conf.size() );
-		std::vector< size_t > field_len( conf.size() );
-
-		// hold unescaped key data for the current line
-		std::vector< char * > key( conf.size() );
-		std::vector< size_t > key_len( conf.size() );
-
-		// current line csv fields
-		char *line = NULL;
-		std::vector< unsigned > field_off( conf.size() );
-
-		// hold pointers to string that were allocated for unescaping (unusual) ; to be freed at the end of the line
-		std::vector< std::string * > str_tofree( conf.size() );
-
-		do
+		merge_mode = merge;
+		inputs = filenames;
+		if ( inputs.empty() )
+			inputs.push_back( NULL );
+
+		// the threads wait for go, so that there is one partition per thread started
+		std::vector< pthread_t > tids( threads > 1 ? threads : 0 );
+		std::vector< thread_arg > args( tids.size() );
+		unsigned nworkers = 0;
+
+		pthread_mutex_lock( &lock );
+		for ( ; nworkers < tids.size() ; ++nworkers )
 		{
-			// read fields
-			unsigned f_off = 0;
-			unsigned f_len = 0;
-			unsigned n_fields = 0;
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
-			{
-				if ( n_fields >= conf.size() )
-					continue;
-
-				field_off[ n_fields ] = f_off;
-				field_len[ n_fields ] = f_len;
-
-				++n_fields;
-			}
-			if ( n_fields < conf.size() )
-			{
-				unsigned snap_sz = f_off + f_len;
-				if ( snap_sz > 32 )
-					snap_sz = 32;
-				std::cerr << "Bad field count, skipping line near " << std::string( line, snap_sz ) << std::endl;
-
-				continue;
-			}
-
-			for ( unsigned i = 0 ; i < n_fields ; ++i )
+			args[ nworkers ].self = this;
+			args[ nworkers ].w.id = nworkers;
+			int err = pthread_create( &tids[ nworkers ], NULL, worker_thread, &args[ nworkers ] );
+			if ( err )
 			{
-				char *uf = line + field_off[ i ];
-				unsigned ul = field_len[ i ];
-				std::string *s = reader->unescape_csv_field( &uf, &ul );
-
-				if ( s )
-				{
-					str_tofree[ i ] = s;
-					uf = (char *)s->data();
-					ul = s->size();
-				}
-				field[ i ] = uf;
-				field_len[ i ] = ul;
-
-				if ( conf[ i ].aggregator->key )
-				{
-					key[ i ] = field[ i ];
-					key_len[ i ] = field_len[ i ];
-
-					conf[ i ].aggregator->key( &key[ i ], &key_len[ i ] );
-				}
+				std::cerr << "Cannot start worker threads: " << strerror( err ) << std::endl;
+				break;
 			}
+		}
 
-			// aggregate
-			int first = 0;
-			u_data *p = aggreg_find_or_create( key, key_len, &first );
-
-			for ( unsigned i = 0 ; i < n_fields ; ++i )
-			{
-				if ( conf[ i ].aggregator->merge )
-				{
-					std::string s( field[ i ], field_len[ i ] );
-					conf[ i ].aggregator->merge( p + i, &s, first );
-				}
-
-				if ( str_tofree[ i ] )
-				{
-					delete str_tofree[ i ];
-					str_tofree[ i ] = NULL;
-				}
-			}
+		for ( unsigned i = 0 ; i < ( nworkers > 0 ? nworkers : 1 ) ; ++i )
+			add_partition();
+		go = true;
+		pthread_cond_broadcast( &cond );
+		pthread_mutex_unlock( &lock );
 
-		} while ( reader->fetch_line() );
+		if ( nworkers == 0 )
+			for ( unsigned i = 0 ; i < inputs.size() ; ++i )
+				read_input( inputs[ i ], NULL, threads );
 
-		delete reader;
+		for ( unsigned i = 0 ; i < nworkers ; ++i )
+			pthread_join( tids[ i ], NULL );
 	}
 
 
-	// dump all aggregated data to an output CSV
-	// clears aggreg
-	void dump_output( const char *filename )
+	// dump all aggregated data to an output CSV, gzip compressed if gzip is set
+	// partial: output the state of the aggregators that cannot be merged from their final value, for a later merge
+	void dump_output( const char *filename, const bool gzip, const bool partial )
 	{
-		output_buffer outbuf( filename, 1024*1024 );
+		output_buffer outbuf( filename, 1024*1024, threads > 1, ( gzip ? threads : 0 ) );
 
 		for ( unsigned i = 0 ; i < conf.size() ; ++i )
 		{
@@ -835,20 +1634,25 @@ public:
 		}
 		outbuf.append_nl();
 
-		uint16_t iter[8];
-		u_data_aggreg.iter_init( iter, 8 );
-		u_data *p;
-		while ( ( p = (u_data *)u_data_aggreg.iter_next( iter ) ) )
+		// the partitions hold increasing ranges of hashes
+		for ( unsigned n = 0 ; n < parts.size() ; ++n )
 		{
-			for ( unsigned i = 0 ; i < conf.size() ; ++i )
+			if ( hash_store )
 			{
-				if ( i > 0 )
-					outbuf.append( ',' );
-
-				if ( conf[ i ].aggregator->out )
-					conf[ i ].aggregator->out( p + i, outbuf );
+				swiss_table::iter iter;
+				parts[ n ]->u_data_table.iter_init( &iter );
+				u_data *p;
+				while ( ( p = (u_data *)parts[ n ]->u_data_table.iter_next( &iter ) ) )
+					dump_row( p, outbuf, partial );
+			}
+			else
+			{
+				uint16_t iter[8];
+				parts[ n ]->u_data_aggreg.iter_init( iter, 8 );
+				u_data *p;
+				while ( ( p = (u_data *)parts[ n ]->u_data_aggreg.iter_next( iter ) ) )
+					dump_row( p, outbuf, partial );
 			}
-			outbuf.append_nl();
 		}
 	}
 
@@ -865,9 +1669,16 @@ static const char *usage =
 "          -V                 display version information and exit\n"
 "          -h                 display help (this text) and exit\n"
 "          -o <outfile>       specify output file (default=stdout)\n"
+"          -z                 compress the output with gzip (bgzf, compressed by -j threads), default if outfile ends with .gz\n"
 "          -L <max line len>  specify maximum line length allowed (default=64k)\n"
+"          -B <block size>    specify input read buffer size (default=4M)\n"
+"          -j <threads>       number of threads (default=1, at most 1024), >1 reads and aggregates input files in parallel, rows are\n"
+"                             partitioned between threads by key hash ; also decompresses input and writes output in background threads\n"
 "          -m                 inputs are partial outputs from csv_aggr (map-reduce style)\n"
+"          -p                 output partial results for a later -m: state of avg/variance/stddev, exact numbers\n"
 "          -d <directory>     directory to store temporary swap files ; should have lots of free space\n"
+"          -t <store>         aggregated data store: tree (default, output sorted by key hash) or hash (open addressing\n"
+"                             hash table, faster with millions of keys, output in table order)\n"
 ;
 
 
@@ -883,10 +1694,15 @@ int main ( int argc, char * argv[] )
 	int opt;
 	char *outfile = NULL;
 	unsigned line_max = 64*1024;
+	unsigned block_size = 4*1024*1024;
+	unsigned threads = 1;
 	bool merge = false;
+	bool partial = false;
+	bool gzip = false;
+	bool hash_store = false;
 	std::string bigtmpdir = "";
 
-	while ( (opt = getopt(argc, argv, "hVo:L:md:")) != -1 )
+	while ( (opt = getopt(argc, argv, "hVo:zL:B:j:mpd:t:")) != -1 )
 	{
 		switch (opt)
 		{
@@ -902,18 +1718,53 @@ int main ( int argc, char * argv[] )
 			outfile = optarg;
 			break;
 
+		case 'z':
+			gzip = true;
+			break;
+
 		case 'L':
 			line_max = strtoul( optarg, NULL, 0 );
 			break;
 
+		case 'B':
+			block_size = strtoul( optarg, NULL, 0 );
+			break;
+
+		case 'j':
+		{
+			// each thread gets a partition of the keys and its own reader: a negative count would wrap to billions
+			unsigned long n = strtoul( optarg, NULL, 0 );
+			if ( n == 0 || n > 1024 )
+			{
+				std::cerr << "Invalid thread count: " << optarg << std::endl << usage << std::endl;
+				return EXIT_FAILURE;
+			}
+			threads = n;
+			break;
+		}
+
 		case 'm':
 			merge = true;
 			break;
 
+		case 'p':
+			partial = true;
+			break;
+
 		case 'd':
 			bigtmpdir = std::string( optarg );
 			break;
 
+		case 't':
+			if ( std::string( optarg ) == "hash" )
+				hash_store = true;
+			else if ( std::string( optarg ) != "tree" )
+			{
+				std::cerr << "Invalid store: " << optarg << std::endl << usage << std::endl;
+				return EXIT_FAILURE;
+			}
+			break;
+
 		default:
 			std::cerr << "Unknwon option: " << opt << std::endl << usage << std::endl;
 			return EXIT_FAILURE;
@@ -926,28 +1777,18 @@ int main ( int argc, char * argv[] )
 		return EXIT_FAILURE;
 	}
 
-	csv_aggreg aggregator( bigtmpdir, line_max );
+	csv_aggreg aggregator( bigtmpdir, line_max, block_size, threads, hash_store );
 
 	if ( aggregator.parse_aggregate_descriptor( argv[ optind++ ] ) )
 		return EXIT_FAILURE;
 
-	if ( optind >= argc )
-	{
-		if ( merge )
-			aggregator.merge( NULL );
-		else
-			aggregator.aggregate( NULL );
-	}
-	else
-	{
-		for ( int i = optind ; i < argc ; ++i )
-			if ( merge )
-				aggregator.merge( argv[ i ] );
-			else
-				aggregator.aggregate( argv[ i ] );
-	}
+	std::vector< const char * > inputs( argv + optind, argv + argc );
+	aggregator.aggregate( inputs, merge );
+
+	if ( output_buffer::gzip_filename( outfile ) )
+		gzip = true;
 
-	aggregator.dump_output( outfile );
+	aggregator.dump_output( outfile, gzip, partial );
 
 	return EXIT_SUCCESS;
 }
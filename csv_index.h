@@ -0,0 +1,243 @@
+#ifndef CSV_INDEX_H
+#define CSV_INDEX_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CSV_INDEX_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * structural index of a csv row
+ * the row is classified by blocks of 64 bytes into separator and quote bitmasks, the quoted areas are the
+ * prefix xor of the quote mask, and the separators outside of them delimit the fields
+ * rows where quotes do not follow the csv rules (quote inside an unquoted field, data after a closing quote,
+ * quoted field not closed on the row) are rejected, the caller then uses its byte-by-byte parser
+ */
+
+// for each block of 64 bytes, store in masks the separator mask, the quote mask and the prefix xor of the quote mask
+typedef void (*csv_classify_fn)( const char *ptr, unsigned nblocks, char sep, char quot, uint64_t *masks );
+
+inline uint64_t csv_prefix_xor ( uint64_t x )
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+
+	return x;
+}
+
+inline void csv_classify_scalar ( const char *ptr, unsigned nblocks, char sep, char quot, uint64_t *masks )
+{
+	for ( unsigned b = 0 ; b < nblocks ; ++b, ptr += 64, masks += 3 )
+	{
+		uint64_t s = 0, q = 0;
+		for ( unsigned i = 0 ; i < 64 ; ++i )
+		{
+			s |= (uint64_t)( ptr[ i ] == sep ) << i;
+			q |= (uint64_t)( ptr[ i ] == quot ) << i;
+		}
+
+		masks[ 0 ] = s;
+		masks[ 1 ] = q;
+		masks[ 2 ] = csv_prefix_xor( q );
+	}
+}
+
+#ifdef CSV_INDEX_X86
+inline void csv_classify_sse2 ( const char *ptr, unsigned nblocks, char sep, char quot, uint64_t *masks )
+{
+	const __m128i vsep = _mm_set1_epi8( sep );
+	const __m128i vquot = _mm_set1_epi8( quot );
+
+	for ( unsigned b = 0 ; b < nblocks ; ++b, ptr += 64, masks += 3 )
+	{
+		uint64_t s = 0, q = 0;
+		for ( unsigned i = 0 ; i < 4 ; ++i )
+		{
+			__m128i v = _mm_loadu_si128( (const __m128i *)( ptr + 16*i ) );
+			s |= (uint64_t)(unsigned)_mm_movemask_epi8( _mm_cmpeq_epi8( v, vsep ) ) << ( 16*i );
+			q |= (uint64_t)(unsigned)_mm_movemask_epi8( _mm_cmpeq_epi8( v, vquot ) ) << ( 16*i );
+		}
+
+		masks[ 0 ] = s;
+		masks[ 1 ] = q;
+		masks[ 2 ] = csv_prefix_xor( q );
+	}
+}
+
+__attribute__((target("avx2,pclmul")))
+inline void csv_classify_avx2 ( const char *ptr, unsigned nblocks, char sep, char quot, uint64_t *masks )
+{
+	const __m256i vsep = _mm256_set1_epi8( sep );
+	const __m256i vquot = _mm256_set1_epi8( quot );
+	const __m128i ones = _mm_set1_epi8( -1 );
+
+	for ( unsigned b = 0 ; b < nblocks ; ++b, ptr += 64, masks += 3 )
+	{
+		__m256i lo = _mm256_loadu_si256( (const __m256i *)ptr );
+		__m256i hi = _mm256_loadu_si256( (const __m256i *)( ptr + 32 ) );
+
+		uint64_t s = (uint64_t)(unsigned)_mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, vsep ) ) |
+			(uint64_t)(unsigned)_mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, vsep ) ) << 32;
+		uint64_t q = (uint64_t)(unsigned)_mm256_movemask_epi8( _mm256_cmpeq_epi8( lo, vquot ) ) |
+			(uint64_t)(unsigned)_mm256_movemask_epi8( _mm256_cmpeq_epi8( hi, vquot ) ) << 32;
+
+		masks[ 0 ] = s;
+		masks[ 1 ] = q;
+		// carry-less multiplication by all ones: prefix xor
+		masks[ 2 ] = _mm_cvtsi128_si64( _mm_clmulepi64_si128( _mm_cvtsi64_si128( q ), ones, 0 ) );
+	}
+}
+#endif
+
+inline csv_classify_fn csv_classify_select ( )
+{
+#ifdef CSV_INDEX_X86
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "pclmul" ) )
+		return csv_classify_avx2;
+
+	return csv_classify_sse2;
+#else
+	return csv_classify_scalar;
+#endif
+}
+
+enum {
+	CSV_INDEX_IRREGULAR = -1,	// the quotes of the row do not follow the csv rules
+	CSV_INDEX_OPEN = -2,	// the row ends inside a quoted field, that may continue on the next line
+	CSV_INDEX_PARTIAL = -3,	// enough separators were found, the end of the row is not indexed yet
+};
+
+// state of csv_index_resume(), at the start of a block
+struct csv_index_state {
+	unsigned off;	// offset of the block in the row
+	unsigned n;	// separators found before off
+	uint64_t inside;	// all ones if the previous block ended inside a quoted field
+	uint64_t prev;	// the char before the block may precede an opening quote (row start, separator, closing quote)
+	uint64_t close;	// the last char of the previous block is a closing quote
+};
+
+inline void csv_index_init ( csv_index_state *st )
+{
+	st->off = 0;
+	st->n = 0;
+	st->inside = 0;
+	st->prev = 1;
+	st->close = 0;
+}
+
+// index the separators of a csv row (without its newline) that are outside of quoted fields, from st->off
+// store their offsets in seps, which needs room for len entries
+// return the number of separators, or CSV_INDEX_IRREGULAR / CSV_INDEX_OPEN
+// st is left at the start of the last block, so that indexing can resume there if the row grows
+// once more than want separators are found, may stop before the last block and return CSV_INDEX_PARTIAL,
+// st->n separators are then stored and indexing resumes at st->off
+inline int csv_index_resume ( const char *row, unsigned len, char sep, char quot, unsigned *seps, csv_index_state *st, unsigned want = ~0U )
+{
+	enum {
+		BATCH = 16,	// blocks classified per call
+	};
+
+	static const csv_classify_fn classify = csv_classify_select();
+
+	uint64_t masks[ 3*BATCH ];
+	char tail[ 64 ];
+	uint64_t inside = st->inside;
+	uint64_t prev = st->prev;
+	uint64_t close = st->close;
+	unsigned n = st->n;
+	unsigned off = st->off;
+
+	while ( off < len )
+	{
+		const char *ptr = row + off;
+		unsigned nblocks = ( len - off ) / 64;
+
+		if ( nblocks == 0 )
+		{
+			// pad the last block with a non-structural char
+			char pad = 0;
+			while ( pad == sep || pad == quot )
+				++pad;
+			memset( tail, pad, 64 );
+			memcpy( tail, ptr, len - off );
+			ptr = tail;
+			nblocks = 1;
+		}
+		else if ( nblocks > BATCH )
+			nblocks = BATCH;
+
+		classify( ptr, nblocks, sep, quot, masks );
+
+		for ( unsigned b = 0 ; b < nblocks ; ++b, off += 64 )
+		{
+			uint64_t s = masks[ 3*b ];
+			uint64_t q = masks[ 3*b + 1 ];
+			uint64_t in = masks[ 3*b + 2 ] ^ inside;
+			uint64_t opening = q & in;
+			uint64_t closing = q & ~in;
+			unsigned rem = len - off;
+
+			// the last block depends on the row end
+			if ( rem <= 64 )
+			{
+				st->off = off;
+				st->n = n;
+				st->inside = inside;
+				st->prev = prev;
+				st->close = close;
+			}
+
+			// opening quote: at a field start, or right after a closing quote (escaped quote)
+			if ( opening & ~( ( s | closing ) << 1 | prev ) )
+				return CSV_INDEX_IRREGULAR;
+
+			// closing quote: followed by a separator, a quote, or the end of the row
+			if ( close && ! ( ( s | q ) & 1 ) )
+				return CSV_INDEX_IRREGULAR;
+
+			uint64_t after = ( s | q ) >> 1 | 1ULL << ( rem < 64 ? rem - 1 : 63 );
+			if ( closing & ~after )
+				return CSV_INDEX_IRREGULAR;
+
+			close = ( rem > 64 ? closing >> 63 : 0 );
+			prev = ( s | closing ) >> 63;
+			inside = 0 - ( in >> 63 );
+
+			for ( uint64_t m = s & ~in ; m ; m &= m - 1 )
+				seps[ n++ ] = off + __builtin_ctzll( m );
+		}
+
+		if ( n > want && off + 64 < len )
+		{
+			st->off = off;
+			st->n = n;
+			st->inside = inside;
+			st->prev = prev;
+			st->close = close;
+
+			return CSV_INDEX_PARTIAL;
+		}
+	}
+
+	if ( inside )
+		return CSV_INDEX_OPEN;
+
+	return n;
+}
+
+inline int csv_index_row ( const char *row, unsigned len, char sep, char quot, unsigned *seps )
+{
+	csv_index_state st;
+	csv_index_init( &st );
+
+	return csv_index_resume( row, len, sep, quot, seps, &st );
+}
+
+#endif
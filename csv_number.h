@@ -0,0 +1,328 @@
+#ifndef CSV_NUMBER_H
+#define CSV_NUMBER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+/*
+ * parsing of numbers from csv fields
+ * digits are decoded 8 at a time with SWAR: the chars are loaded in a 64-bit word (first char in the low byte),
+ * validated with bytewise range checks, and combined by pairs, then pairs of pairs, and so on
+ * a scalar fallback is used on big-endian hosts
+ */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CSV_NUMBER_SWAR
+#endif
+
+#ifdef CSV_NUMBER_SWAR
+// set the high bit of the bytes of x that are in m < byte < n, clear the other bits
+// m < 128, n <= 128, bytes >= 128 are never in range
+inline uint64_t csv_bytes_between ( uint64_t x, unsigned m, unsigned n )
+{
+	const uint64_t ones = ~0ULL / 255;
+	const uint64_t low7 = x & ones * 127;
+
+	return ( ones * ( 127 + n ) - low7 ) & ~x & ( low7 + ones * ( 127 - m ) ) & ones * 128;
+}
+
+// load the k (<= 8) chars of s in a word, right aligned after '0' padding, so that they read as leading zeros
+inline uint64_t csv_load_digits ( const char *s, unsigned k )
+{
+	uint64_t x = 0x3030303030303030ULL;
+	memcpy( (char *)&x + 8 - k, s, k );
+
+	return x;
+}
+
+// decode k (<= 8) hex digits, return false on an invalid char
+inline bool csv_hex8 ( const char *s, unsigned k, uint64_t *ret )
+{
+	const uint64_t ones = ~0ULL / 255;
+	uint64_t x = csv_load_digits( s, k );
+
+	uint64_t valid = csv_bytes_between( x, '0' - 1, '9' + 1 ) |
+		csv_bytes_between( x, 'a' - 1, 'f' + 1 ) |
+		csv_bytes_between( x, 'A' - 1, 'F' + 1 );
+	if ( valid != ones * 128 )
+		return false;
+
+	// nibble values: low nibble of the char, + 9 for letters (bit 6 set)
+	x = ( x & ones * 15 ) + ( ( x >> 6 ) & ones ) * 9;
+
+	// the first digit is the most significant
+	x = ( ( x & 0x000f000f000f000fULL ) << 4 ) | ( ( x >> 8 ) & 0x000f000f000f000fULL );
+	x = ( ( x & 0x000000ff000000ffULL ) << 8 ) | ( ( x >> 16 ) & 0x000000ff000000ffULL );
+	x = ( ( x & 0xffff ) << 16 ) | ( ( x >> 32 ) & 0xffff );
+
+	*ret = x;
+	return true;
+}
+
+// decode k (<= 8) decimal digits, return false on an invalid char
+inline bool csv_dec8 ( const char *s, unsigned k, uint64_t *ret )
+{
+	const uint64_t ones = ~0ULL / 255;
+	uint64_t x = csv_load_digits( s, k );
+
+	if ( csv_bytes_between( x, '0' - 1, '9' + 1 ) != ones * 128 )
+		return false;
+
+	x &= ones * 15;
+
+	// the first digit is the most significant
+	x = ( x * 10 + ( x >> 8 ) ) & 0x00ff00ff00ff00ffULL;
+	x = ( x * 100 + ( x >> 16 ) ) & 0x0000ffff0000ffffULL;
+	x = ( x * 10000 + ( x >> 32 ) ) & 0xffffffffULL;
+
+	*ret = x;
+	return true;
+}
+#else
+inline bool csv_hex8 ( const char *s, unsigned k, uint64_t *ret )
+{
+	uint64_t x = 0;
+
+	for ( unsigned i = 0 ; i < k ; ++i )
+	{
+		char c = s[ i ];
+		if ( c >= '0' && c <= '9' )
+			x = x * 16 + ( c - '0' );
+		else if ( c >= 'a' && c <= 'f' )
+			x = x * 16 + ( c - 'a' + 10 );
+		else if ( c >= 'A' && c <= 'F' )
+			x = x * 16 + ( c - 'A' + 10 );
+		else
+			return false;
+	}
+
+	*ret = x;
+	return true;
+}
+
+inline bool csv_dec8 ( const char *s, unsigned k, uint64_t *ret )
+{
+	uint64_t x = 0;
+
+	for ( unsigned i = 0 ; i < k ; ++i )
+	{
+		if ( s[ i ] < '0' || s[ i ] > '9' )
+			return false;
+		x = x * 10 + ( s[ i ] - '0' );
+	}
+
+	*ret = x;
+	return true;
+}
+#endif
+
+// parse len hex digits (no prefix, any number of leading zeros)
+// return false if a char is not a hex digit, or if the value does not fit in 64 bits
+inline bool csv_parse_hex ( const char *s, unsigned len, uint64_t *ret )
+{
+	while ( len > 16 && *s == '0' )
+	{
+		++s;
+		--len;
+	}
+
+	if ( len > 16 )
+		return false;
+
+	uint64_t hi = 0, lo;
+
+	if ( len > 8 )
+	{
+		if ( ! csv_hex8( s, len - 8, &hi ) )
+			return false;
+		s += len - 8;
+		len = 8;
+	}
+
+	if ( ! csv_hex8( s, len, &lo ) )
+		return false;
+
+	*ret = hi << 32 | lo;
+	return true;
+}
+
+// parse len decimal digits (any number of leading zeros), an empty string is 0
+// return false if a char is not a digit, or if the value does not fit in 64 bits
+inline bool csv_parse_dec ( const char *s, unsigned len, uint64_t *ret )
+{
+	while ( len > 20 && *s == '0' )
+	{
+		++s;
+		--len;
+	}
+
+	if ( len > 20 )
+		return false;
+
+	// chunks of 8 digits, the first one takes the remainder
+	uint64_t v = 0;
+	unsigned k = ( len % 8 ? len % 8 : 8 );
+
+	for ( ; len > 0 ; s += k, len -= k, k = 8 )
+	{
+		uint64_t chunk;
+		if ( ! csv_dec8( s, k, &chunk ) )
+			return false;
+
+		// at most 20 digits: only the last step may overflow, when v holds 12 digits
+		if ( v > ( ~0ULL - chunk ) / 100000000ULL )
+			return false;
+
+		v = v * 100000000ULL + chunk;
+	}
+
+	*ret = v;
+	return true;
+}
+
+/*
+ * parsing of signed decimal numbers, with an optional fraction and exponent (eg "-12", "3.25", "1e-3", ".5")
+ * the significant digits are decoded with csv_parse_dec() ; when there are at most 19 of them and the power of 10 is
+ * at most 22, both are exact doubles and a single multiplication or division gives the correctly rounded value, other
+ * numbers (rare in csv data) are converted by strtod()
+ */
+
+enum {
+	CSV_NUM_NONE,	// not a number
+	CSV_NUM_INT,	// integer, in *iv
+	CSV_NUM_FLOAT,	// in *dv
+};
+
+// parse s as a decimal number, surrounded by optional spaces
+// an integer without fraction nor exponent that fits in a long long is returned in *iv, other numbers in *dv
+inline int csv_parse_number ( const char *s, size_t len, long long *iv, double *dv )
+{
+	static const double dpow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	static const uint64_t upow10[] = {
+		1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+		1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+		100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+		1000000000000000000ULL, 10000000000000000000ULL
+	};
+
+	const char *end = s + len;
+	while ( s < end && ( *s == ' ' || *s == '\t' ) )
+		++s;
+	while ( end > s && ( end[ -1 ] == ' ' || end[ -1 ] == '\t' ) )
+		--end;
+
+	const char *start = s;
+	bool neg = false;
+	if ( s < end && ( *s == '-' || *s == '+' ) )
+		neg = ( *s++ == '-' );
+
+	// integer digits, fraction digits
+	const char *ip = s;
+	while ( s < end && *s >= '0' && *s <= '9' )
+		++s;
+	size_t il = s - ip;
+
+	const char *fp = s;
+	size_t fl = 0;
+	bool frac = false;
+	if ( s < end && *s == '.' )
+	{
+		frac = true;
+		fp = ++s;
+		while ( s < end && *s >= '0' && *s <= '9' )
+			++s;
+		fl = s - fp;
+	}
+
+	if ( il + fl == 0 )
+		return CSV_NUM_NONE;
+
+	long e10 = 0;
+	bool has_exp = false;
+	if ( s < end && ( *s == 'e' || *s == 'E' ) )
+	{
+		has_exp = true;
+		++s;
+		bool eneg = false;
+		if ( s < end && ( *s == '-' || *s == '+' ) )
+			eneg = ( *s++ == '-' );
+		if ( s == end )
+			return CSV_NUM_NONE;
+		for ( ; s < end && *s >= '0' && *s <= '9' ; ++s )
+			if ( e10 < 100000 )
+				e10 = e10 * 10 + ( *s - '0' );
+		if ( eneg )
+			e10 = -e10;
+	}
+
+	if ( s != end )
+		return CSV_NUM_NONE;
+
+	uint64_t m;
+	if ( !frac && !has_exp && csv_parse_dec( ip, il, &m ) && m <= (uint64_t)1 << 63 )
+	{
+		if ( !neg && m == (uint64_t)1 << 63 )
+			goto slow;
+		*iv = ( neg ? (long long)( 0 - m ) : (long long)m );
+		return CSV_NUM_INT;
+	}
+
+	// significant digits only: no leading zeros, no trailing zeros in the fraction
+	while ( il > 0 && *ip == '0' )
+	{
+		++ip;
+		--il;
+	}
+	while ( fl > 0 && fp[ fl - 1 ] == '0' )
+		--fl;
+	if ( il == 0 )
+		while ( fl > 0 && *fp == '0' )
+		{
+			++fp;
+			--fl;
+			--e10;
+		}
+
+	if ( il + fl <= 19 )
+	{
+		uint64_t hi = 0, lo = 0;
+		csv_parse_dec( ip, il, &hi );
+		csv_parse_dec( fp, fl, &lo );
+		m = hi * upow10[ fl ] + lo;
+		e10 -= (long)fl;
+
+		if ( m == 0 )
+		{
+			*dv = ( neg ? -0.0 : 0.0 );
+			return CSV_NUM_FLOAT;
+		}
+
+		if ( m <= (uint64_t)1 << 53 && e10 >= -22 && e10 <= 22 )
+		{
+			double d = (double)m;
+			d = ( e10 < 0 ? d / dpow10[ -e10 ] : d * dpow10[ e10 ] );
+			*dv = ( neg ? -d : d );
+			return CSV_NUM_FLOAT;
+		}
+	}
+
+slow:
+	char buf[ 64 ];
+	if ( (size_t)( end - start ) < sizeof(buf) )
+	{
+		memcpy( buf, start, end - start );
+		buf[ end - start ] = 0;
+		*dv = strtod( buf, NULL );
+	}
+	else
+		*dv = strtod( std::string( start, end - start ).c_str(), NULL );
+
+	return CSV_NUM_FLOAT;
+}
+
+#endif
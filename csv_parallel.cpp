@@ -0,0 +1,343 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+#include <vector>
+#include <sys/mman.h>
+
+#include "csv_parallel.h"
+#include "csv_reader.h"
+#include "output_buffer.h"
+
+// states of the csv_reader parser, for guess_row_start()
+enum {
+	GUESS_FIELD_START,
+	GUESS_UNQUOTED,
+	GUESS_QUOTED,
+	GUESS_QUOTE_END,	// quote in a quoted field: closing or escaped
+	GUESS_QUOTE_END_CR,
+	GUESS_BAD,	// syntax error, the rest of the line is ignored
+};
+
+// advance the parser state over c, count the quotes unlikely in a well-formed csv in odd
+// return true if c ends a row
+static bool guess_step ( int *state, const char c, const char sep, const char quot, unsigned *odd )
+{
+	switch ( *state )
+	{
+	case GUESS_FIELD_START:
+		if ( c == quot )
+			*state = GUESS_QUOTED;
+		else if ( c == '\n' )
+			return true;
+		else if ( c != sep )
+			*state = GUESS_UNQUOTED;
+		break;
+
+	case GUESS_UNQUOTED:
+		if ( c == quot )
+			++*odd;
+		else if ( c == sep )
+			*state = GUESS_FIELD_START;
+		else if ( c == '\n' )
+		{
+			*state = GUESS_FIELD_START;
+			return true;
+		}
+		break;
+
+	case GUESS_QUOTED:
+		if ( c == quot )
+			*state = GUESS_QUOTE_END;
+		break;
+
+	case GUESS_QUOTE_END:
+		if ( c == quot )
+			*state = GUESS_QUOTED;
+		else if ( c == sep )
+			*state = GUESS_FIELD_START;
+		else if ( c == '\n' )
+		{
+			*state = GUESS_FIELD_START;
+			return true;
+		}
+		else if ( c == '\r' )
+			*state = GUESS_QUOTE_END_CR;
+		else
+		{
+			*state = GUESS_BAD;
+			++*odd;
+		}
+		break;
+
+	case GUESS_QUOTE_END_CR:
+		if ( c == '\n' )
+		{
+			*state = GUESS_FIELD_START;
+			return true;
+		}
+		*state = GUESS_BAD;
+		++*odd;
+		break;
+
+	case GUESS_BAD:
+		if ( c == '\n' )
+		{
+			*state = GUESS_FIELD_START;
+			return true;
+		}
+		break;
+	}
+
+	return false;
+}
+
+// guess the offset of the first row starting in data[0..len), data[-1] must be readable
+// the parser state before data[-1] is unknown: the parser is run from each possible state (in an unquoted field,
+// at a field start, in a quoted field) until they all reach the same state; the hypothesis that saw the less
+// unusual quotes is kept
+// return len if no row starts in data
+static unsigned guess_row_start ( const char *data, const unsigned len, const char sep, const char quot )
+{
+	enum {
+		HYPOTHESES = 3,
+	};
+
+	int state[ HYPOTHESES ] = { GUESS_UNQUOTED, GUESS_FIELD_START, GUESS_QUOTED };
+	unsigned first[ HYPOTHESES ] = { len, len, len };
+	unsigned odd[ HYPOTHESES ] = { 0, 0, 0 };
+	int off = -1;
+
+	for ( ; off < (int)len && ( state[ 0 ] != state[ 1 ] || state[ 0 ] != state[ 2 ] ) ; ++off )
+		for ( unsigned h = 0 ; h < HYPOTHESES ; ++h )
+			if ( guess_step( &state[ h ], data[ off ], sep, quot, &odd[ h ] ) && first[ h ] == len )
+				first[ h ] = off + 1;
+
+	unsigned best = 0;
+	for ( unsigned h = 1 ; h < HYPOTHESES ; ++h )
+		if ( odd[ h ] < odd[ best ] )
+			best = h;
+
+	if ( first[ best ] < len )
+		return first[ best ];
+
+	// the hypotheses agree from off
+	for ( ; off < (int)len ; ++off )
+		if ( guess_step( &state[ best ], data[ off ], sep, quot, &odd[ best ] ) )
+			return off + 1;
+
+	return len;
+}
+
+csv_parallel::csv_parallel ( csv_reader *reader, const char sep, const char quot, const unsigned line_max, const unsigned chunk_size, const unsigned threads ) :
+	reader(reader),
+	sep(sep),
+	quot(quot),
+	line_max(line_max),
+	chunk_size(chunk_size),
+	threads(threads),
+	fd(-1),
+	file_size(0),
+	base(0),
+	fn(NULL),
+	arg(NULL),
+	slot(NULL),
+	nslots(0),
+	nchunks(0),
+	next_chunk(0),
+	next_output(0),
+	stop(false)
+{
+	// a chunk and its last row are parsed by one csv_reader
+	if ( this->chunk_size > 1024*1024*1024 )
+		this->chunk_size = 1024*1024*1024;
+	// each chunk costs a mapping, a row start guess and its validation: tiny chunks would take longer than the rows
+	if ( this->chunk_size < line_max )
+		this->chunk_size = line_max;
+	if ( this->chunk_size < 64*1024 )
+		this->chunk_size = 64*1024;
+
+	pthread_mutex_init( &lock, NULL );
+	pthread_cond_init( &cond, NULL );
+}
+
+csv_parallel::~csv_parallel ( )
+{
+	for ( unsigned i = 0 ; i < nslots ; ++i )
+		delete slot[ i ].output;
+	delete[] slot;
+
+	pthread_cond_destroy( &cond );
+	pthread_mutex_destroy( &lock );
+}
+
+// process the rows of c, from c->first, or from a guessed row start if guess is set
+// the workers run quiet, errors are reported when the consumer processes the chunk again
+void csv_parallel::process_chunk ( chunk *c, unsigned worker, bool guess )
+{
+	static const off_t page_mask = sysconf( _SC_PAGESIZE ) - 1;
+
+	off_t start = ( guess ? c->start : c->first );
+
+	c->output->clear();
+	c->error = false;
+	c->first = c->next = start;
+
+	// the last row of the previous chunk covers this one
+	if ( start >= c->end )
+		return;
+
+	// map the chunk, the byte before it for the guess, and enough data after it for its last row
+	off_t map_off = ( start - ( start > 0 ? 1 : 0 ) ) & ~page_mask;
+	off_t map_end = c->end + line_max;
+	if ( map_end > file_size )
+		map_end = file_size;
+
+	void *ptr = mmap( NULL, map_end - map_off, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, map_off );
+	if ( ptr == MAP_FAILED )
+	{
+		std::cerr << "mmap: " << strerror( errno ) << std::endl;
+		c->error = true;
+		return;
+	}
+	madvise( ptr, map_end - map_off, MADV_SEQUENTIAL );
+
+	if ( guess )
+		c->first = c->next = start + guess_row_start( (char *)ptr + ( start - map_off ), map_end - start, sep, quot );
+
+	if ( c->first < c->end )
+	{
+		csv_reader rows( (char *)ptr + ( c->first - map_off ), map_end - c->first, c->end - c->first, map_end < file_size, sep, quot, line_max, worker < threads );
+
+		if ( rows.fetch_line() )
+			fn( arg, worker, &rows, c->output );
+
+		c->next = c->first + rows.range_offset();
+		c->error = rows.input_error();
+	}
+
+	munmap( ptr, map_end - map_off );
+}
+
+// worker thread main loop: process the chunks in order, up to nslots chunks ahead of the consumer
+void csv_parallel::work ( unsigned worker )
+{
+	pthread_mutex_lock( &lock );
+	for (;;)
+	{
+		while ( ! stop && next_chunk < nchunks && next_chunk >= next_output + nslots )
+			pthread_cond_wait( &cond, &lock );
+		if ( stop || next_chunk >= nchunks )
+			break;
+
+		chunk *c = &slot[ next_chunk % nslots ];
+		c->start = base + next_chunk * chunk_size;
+		c->end = ( file_size - c->start > chunk_size ? c->start + chunk_size : file_size );
+		c->first = c->start;
+		bool guess = ( next_chunk > 0 );
+		++next_chunk;
+		pthread_mutex_unlock( &lock );
+
+		process_chunk( c, worker, guess );
+
+		pthread_mutex_lock( &lock );
+		c->done = true;
+		pthread_cond_broadcast( &cond );
+	}
+	pthread_mutex_unlock( &lock );
+}
+
+void *csv_parallel::worker_thread ( void *arg )
+{
+	worker_arg *w = (worker_arg *)arg;
+	w->par->work( w->worker );
+	return NULL;
+}
+
+// process the rows of the input of reader, from its current row
+// return false if the input cannot be split (not a mmapped file, less than 2 chunks), nothing is processed then
+bool csv_parallel::run ( process_fn fn, void *arg, output_buffer *out )
+{
+	if ( threads == 0 || ! reader->row_position( &fd, &base, &file_size ) )
+		return false;
+
+	nchunks = ( file_size - base + chunk_size - 1 ) / chunk_size;
+	if ( nchunks < 2 )
+		return false;
+
+	this->fn = fn;
+	this->arg = arg;
+
+	nslots = 2 * threads;
+	slot = new chunk[ nslots ];
+	for ( unsigned i = 0 ; i < nslots ; ++i )
+	{
+		slot[ i ].done = false;
+		slot[ i ].output = new output_buffer( 64*1024 );
+	}
+
+	pthread_t *workers = new pthread_t[ threads ];
+	worker_arg *args = new worker_arg[ threads ];
+	unsigned nworkers = 0;
+	for ( ; nworkers < threads ; ++nworkers )
+	{
+		args[ nworkers ].par = this;
+		args[ nworkers ].worker = nworkers;
+		if ( pthread_create( &workers[ nworkers ], NULL, worker_thread, &args[ nworkers ] ) )
+			break;
+	}
+
+	if ( nworkers == 0 )
+	{
+		std::cerr << "Cannot start worker threads: " << strerror( errno ) << std::endl;
+		delete[] args;
+		delete[] workers;
+		return false;
+	}
+
+	off_t prev_next = base;
+	for ( unsigned long long i = 0 ; i < nchunks ; ++i )
+	{
+		chunk *c = &slot[ i % nslots ];
+
+		pthread_mutex_lock( &lock );
+		while ( ! c->done )
+			pthread_cond_wait( &cond, &lock );
+		pthread_mutex_unlock( &lock );
+
+		// wrong guess for the first row, or error to report: process the chunk again on this thread
+		if ( c->first != prev_next || c->error )
+		{
+			c->first = prev_next;
+			process_chunk( c, threads, false );
+		}
+
+		unsigned len;
+		const char *data = c->output->memory( &len );
+		out->append( data, len );
+		prev_next = c->next;
+		bool error = c->error;
+
+		pthread_mutex_lock( &lock );
+		c->done = false;
+		++next_output;
+		pthread_cond_broadcast( &cond );
+		pthread_mutex_unlock( &lock );
+
+		if ( error )
+			break;
+	}
+
+	pthread_mutex_lock( &lock );
+	stop = true;
+	pthread_cond_broadcast( &cond );
+	pthread_mutex_unlock( &lock );
+
+	for ( unsigned i = 0 ; i < nworkers ; ++i )
+		pthread_join( workers[ i ], NULL );
+
+	delete[] args;
+	delete[] workers;
+
+	return true;
+}
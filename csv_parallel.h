@@ -0,0 +1,80 @@
+#ifndef CSV_PARALLEL_H
+#define CSV_PARALLEL_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+class csv_reader;
+class output_buffer;
+
+// process the rows of a mmapped input file on worker threads
+// the file is cut in chunks of chunk_size bytes, each worker maps one chunk, guesses where its first row starts
+// (a quoted field may hold newlines, so a newline is not always a row boundary), and processes the rows starting
+// in the chunk into a private output
+// chunks are validated in file order: the first row of a chunk must start where the previous chunk stopped,
+// otherwise the guess was wrong and the chunk is processed again from the right offset
+// the outputs are appended to the main output in file order
+class csv_parallel
+{
+public:
+	// process all the rows of reader (its current row first, until fetch_line() fails) and write to out
+	// worker identifies the calling thread, from 0 to threads included, for per-thread state
+	typedef void (*process_fn)( void *arg, unsigned worker, csv_reader *reader, output_buffer *out );
+
+	csv_parallel ( csv_reader *reader, const char sep, const char quot, const unsigned line_max, const unsigned chunk_size, const unsigned threads );
+	~csv_parallel ( );
+
+	// process the rows of the input of reader, from its current row
+	// return false if the input cannot be split (not a mmapped file, less than 2 chunks), nothing is processed then
+	bool run ( process_fn fn, void *arg, output_buffer *out );
+
+private:
+	struct chunk {
+		off_t start;	// the chunk holds the rows starting in start..end
+		off_t end;
+		off_t first;	// offset of the first row processed
+		off_t next;	// offset of the row after the last one processed
+		bool error;	// the processing stopped on an error
+		bool done;
+		output_buffer *output;	// memory output, reused by the chunks of the slot
+	};
+
+	csv_reader *reader;
+	char sep;
+	char quot;
+	unsigned line_max;
+	unsigned chunk_size;
+	unsigned threads;
+
+	int fd;
+	off_t file_size;
+	off_t base;	// offset of the first row
+
+	process_fn fn;
+	void *arg;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	chunk *slot;
+	unsigned nslots;
+	unsigned long long nchunks;
+	unsigned long long next_chunk;	// next chunk for the workers
+	unsigned long long next_output;	// next chunk for the consumer
+	bool stop;
+
+	// process the rows of c, from c->first, or from a guessed row start if guess is set
+	void process_chunk ( chunk *c, unsigned worker, bool guess );
+
+	struct worker_arg {
+		csv_parallel *par;
+		unsigned worker;
+	};
+
+	void work ( unsigned worker );
+	static void *worker_thread ( void *arg );
+
+	csv_parallel ( const csv_parallel& );
+	csv_parallel& operator=( const csv_parallel& );
+};
+
+#endif
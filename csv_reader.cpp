@@ -2,25 +2,37 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #ifndef NO_ZLIB
 #include <zlib.h>
 #endif
 
 #include "csv_reader.h"
+#include "csv_index.h"
 
-// wraps an istream, provide an efficient interface to read lines
+// reads a file descriptor, provide an efficient interface to read lines
 // skips UTF-8 BOM
 // interprets UTF-16 BOMs, return iso codepoints - out of range characters are converted to '?'
-// handles gzip compressed inputs
+// handles gzip compressed inputs, including multi-member files (concatenated gzip, bgzf)
+// regular uncompressed files are mmapped, lines are returned directly from the page cache
+// other inputs may be read & decoded by a background thread (read-ahead)
+// a line_reader may also read lines from a memory area, eg a chunk of a mapped file (view mode)
 class line_reader
 {
 private:
-	std::istream *input;
-	bool should_delete_input;
+	int input_fd;
+	bool should_close_input;
+	bool input_at_eof;
+	bool input_aborted;	// read-ahead thread stopped before the end of input
 	bool badfile;
 
 	// maximum line length
@@ -28,6 +40,32 @@ private:
 	unsigned buf_end;
 	unsigned buf_size;
 	char *buf;
+	unsigned eol_end;	// offset in buf after a line end, 0 if unknown (see line_buffered()), reset when data moves
+
+	unsigned line_max;
+	unsigned block_size;
+
+	// mmap mode: buf points to a window of the file, of size buf_size = buf_end
+	// the window is remapped forward when a line crosses its end
+	// map_fd is -1 when reading through input_fd
+	int map_fd;
+	off_t map_off;
+	off_t file_size;
+
+	// view mode: buf is a memory area of size buf_size = buf_end, owned by the caller
+	// read_line() stops at lines starting at or after view_limit
+	// view_truncated: the input continues after buf_end, lines reaching it are too long
+	bool view;
+	bool view_truncated;
+	unsigned view_limit;
+
+	bool quiet;	// do not report line errors
+	bool line_error;	// a line or row was longer than line_max
+
+	// address space budget for one mmap window, must fit in unsigned
+	enum {
+		MAP_WINDOW = ( sizeof(void *) > 4 ? 1024*1024*1024 : 64*1024*1024 ),
+	};
 
 #ifndef NO_ZLIB
 	unsigned zbuf_cur;
@@ -35,6 +73,7 @@ private:
 	unsigned zbuf_size;
 	char *zbuf;
 	z_stream zstream;
+	bool zsplit;	// the next member is bgzf, hand it to the read-ahead workers
 #endif
 
 	// bitmask
@@ -44,28 +83,100 @@ private:
 	};
 	int input_filter;
 
-	// convert utf16 codepoints inplace in buf
-	// return the offset after the last valid character converted
-	unsigned filter_input ( unsigned off_start, unsigned off_end )
+	// read-ahead mode: a thread runs decode_input() into a ring of blocks, refill_buffer() copies them into buf
+	// for bgzf inputs, the thread only splits the compressed stream in batches of whole members
+	// that are inflated by worker threads, blocks are still consumed in order
+	enum {
+		RA_BLOCKS = 4,
+		BGZF_MAX_BLOCK = 64*1024,
+	};
+
+	enum {
+		RA_FREE,
+		RA_TODO,	// compressed members waiting for a worker
+		RA_BUSY,	// being inflated
+		RA_READY,	// data can be consumed
+	};
+
+	struct ra_slot {
+		char *data;
+		unsigned len;
+		char *zdata;	// bgzf members, allocated only when there are workers
+		unsigned zlen;
+		int state;
+		bool last;	// end of input after this block
+	};
+
+	struct read_ahead {
+		pthread_t thread;
+		pthread_t *workers;
+		unsigned nworkers;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		ra_slot *slot;
+		unsigned nblocks;
+		unsigned head;	// next block to consume
+		unsigned count;	// number of blocks in use
+		unsigned head_cur;	// consumer offset in slot[ head ]
+		bool stop;	// set by the consumer to terminate the threads
+		bool eof;	// consumer reached the last block
+	};
+	read_ahead *ra;
+
+	// called before the lines returned so far are overwritten or unmapped
+	void (*release_fn)( void *arg );
+	void *release_arg;
+
+	void release ( )
+	{
+		if ( release_fn )
+			release_fn( release_arg );
+	}
+
+	// called when the input has no data ready, returns the ms to wait before calling it again (~0U: no limit)
+	unsigned (*idle_fn)( void *arg );
+	void *idle_arg;
+
+	// before a read from input_fd that may block: wait for input as long as idle_fn allows, so that it runs again
+	// if the input stalls
+	void wait_idle ( )
+	{
+		for (;;)
+		{
+			unsigned ms = idle_fn( idle_arg );
+			if ( ms == ~0U )
+				return;
+
+			struct pollfd pfd;
+			pfd.fd = input_fd;
+			pfd.events = POLLIN;
+			if ( poll( &pfd, 1, ( ms > INT_MAX ? INT_MAX : (int)ms ) ) != 0 )
+				return;
+		}
+	}
+
+	// convert utf16 codepoints inplace in ptr
+	// return the length of the converted data
+	unsigned filter_input ( char *ptr, unsigned len )
 	{
 		if ( input_filter & (INPUT_FILTER_UTF16BE | INPUT_FILTER_UTF16LE) )
 		{
-			unsigned off_in = off_start;
-			unsigned off_out = off_start;
+			unsigned off_in = 0;
+			unsigned off_out = 0;
 			unsigned high = 0, low = 1;
 			if ( input_filter & INPUT_FILTER_UTF16LE )
 				high = 1, low = 0;
 
-			while ( off_in < off_end )
+			while ( off_in + 1 < len )
 			{
-				if ( buf[ off_in + high ] )
+				if ( ptr[ off_in + high ] )
 				{
-					buf[ off_out++ ] = '?';
+					ptr[ off_out++ ] = '?';
 					off_in += 2;
 				}
 				else
 				{
-					buf[ off_out++ ] = buf[ off_in + low ];
+					ptr[ off_out++ ] = ptr[ off_in + low ];
 					off_in += 2;
 				}
 			}
@@ -73,92 +184,717 @@ private:
 			return off_out;
 		}
 
-		return off_end;
+		return len;
 	}
 
-	// memmove buf_cur to buf_start, fill buf_end..buf_size with freshly read data
-	// convert utf16 according to input_filter
-	void refill_buffer ( )
+	// wait until input_fd is readable or the read-ahead thread is asked to stop
+	// return false if the thread should stop
+	bool ra_wait_input ( )
 	{
-		if ( buf_cur > 0 )
+		for (;;)
 		{
-			if ( buf_end < buf_cur )
-				buf_end = buf_cur;
+			pthread_mutex_lock( &ra->lock );
+			bool stop = ra->stop;
+			pthread_mutex_unlock( &ra->lock );
+			if ( stop )
+				return false;
 
-			memmove( buf, buf + buf_cur, buf_end - buf_cur );
-			buf_end -= buf_cur;
-			buf_cur = 0;
+			struct pollfd pfd;
+			pfd.fd = input_fd;
+			pfd.events = POLLIN;
+			if ( poll( &pfd, 1, 100 ) != 0 )
+				return true;
 		}
+	}
 
-		if ( buf_end < buf_size )
+	// read up to len bytes from input_fd
+	// return at least one byte (a multiple of align bytes) unless the end of input is reached
+	unsigned read_input ( char *ptr, unsigned len, unsigned align = 1 )
+	{
+		unsigned got = 0;
+
+		while ( got < len && ( got == 0 || got % align ) && ! input_at_eof )
 		{
-			unsigned toread = buf_size - buf_end;
-			unsigned old_end = buf_end;
-			if ( input_filter & (INPUT_FILTER_UTF16BE | INPUT_FILTER_UTF16LE) )
-				toread -= toread & 1;
+			if ( ra && ! ra_wait_input() )
+			{
+				input_at_eof = input_aborted = true;
+				break;
+			}
 
-			if ( toread == 0 )
-				return;
+			// the read-ahead thread never calls the hook, the consumer does in ra_fill()
+			if ( ! ra && idle_fn )
+				wait_idle();
+
+			ssize_t ret = ::read( input_fd, ptr + got, len - got );
+			if ( ret > 0 )
+				got += ret;
+			else if ( ret == 0 )
+				input_at_eof = true;
+			else if ( errno != EINTR )
+			{
+				std::cerr << "read: " << strerror( errno ) << std::endl;
+				input_at_eof = true;
+			}
+		}
+
+		return got;
+	}
 
 #ifndef NO_ZLIB
-			if (zbuf) {
-				// shift & refill compressed data if available
-				if ( zbuf_cur > zbuf_size / 2 )
-				{
-					if ( zbuf_end < zbuf_cur )
-						zbuf_end = zbuf_cur;
-					memmove( zbuf, zbuf + zbuf_cur, zbuf_end - zbuf_cur );
-					zbuf_end -= zbuf_cur;
-					zbuf_cur = 0;
-				}
+	// make at least want bytes of compressed data available at zbuf_cur, or zbuf_size bytes
+	// return false if the input ends before
+	bool zbuf_fill ( unsigned want )
+	{
+		if ( want > zbuf_size )
+			want = zbuf_size;
 
-				if ( zbuf_size > zbuf_end )
-				{
-					input->read( zbuf + zbuf_end, zbuf_size - zbuf_end);
-					zbuf_end += input->gcount();
-				}
+		if ( zbuf_cur == zbuf_end )
+			zbuf_cur = zbuf_end = 0;
+		else if ( zbuf_size - zbuf_cur < want )
+		{
+			memmove( zbuf, zbuf + zbuf_cur, zbuf_end - zbuf_cur );
+			zbuf_end -= zbuf_cur;
+			zbuf_cur = 0;
+		}
+
+		while ( zbuf_end - zbuf_cur < want && ! input_at_eof )
+			zbuf_end += read_input( zbuf + zbuf_end, zbuf_size - zbuf_end );
+
+		return zbuf_end - zbuf_cur >= want;
+	}
+
+	// return the total size of the bgzf member starting at ptr (gzip header with a 'BC' extra subfield)
+	// return 0 if this is not a bgzf header, or if the header is not complete in len bytes
+	static unsigned bgzf_member_size ( const char *ptr, unsigned len )
+	{
+		const unsigned char *p = (const unsigned char *)ptr;
+
+		if ( len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || ! ( p[3] & 4 ) )
+			return 0;
+
+		unsigned xend = 12 + ( p[10] | p[11] << 8 );
+		if ( xend > len )
+			return 0;
+
+		for ( unsigned off = 12 ; off + 4 <= xend ; off += 4 + ( p[off+2] | p[off+3] << 8 ) )
+		{
+			if ( p[off] == 'B' && p[off+1] == 'C' && p[off+2] == 2 && p[off+3] == 0 && off + 6 <= xend )
+			{
+				unsigned size = ( p[off+4] | p[off+5] << 8 ) + 1;
+				// header, empty deflate block, crc32 and isize
+				if ( size < xend + 10 )
+					return 0;
+				return size;
+			}
+		}
+
+		return 0;
+	}
+
+	// check that a gzip member starts at zbuf_cur, discard the rest of the input if not
+	bool zbuf_at_member ( )
+	{
+		if ( zbuf_end - zbuf_cur >= 2 && zbuf[ zbuf_cur ] == 0x1f && zbuf[ zbuf_cur + 1 ] == (char)0x8b )
+			return true;
+
+		if ( ! input_aborted )
+			std::cerr << "inflate: trailing data (" << (zbuf_end - zbuf_cur) << " bytes)" << std::endl;
+		zbuf_cur = zbuf_end;
+		input_at_eof = true;
+
+		return false;
+	}
+
+	// called when zstream reaches the end of a gzip member: prepare it for the next member, if any
+	// return false at the end of input
+	bool next_member ( )
+	{
+		zbuf_fill( 18 );
+		if ( zbuf_cur == zbuf_end || ! zbuf_at_member() )
+			return false;
+
+		inflateReset( &zstream );
+
+		// bgzf members can be inflated independently
+		if ( ra && ra->nworkers && bgzf_member_size( zbuf + zbuf_cur, zbuf_end - zbuf_cur ) )
+			zsplit = true;
+
+		return true;
+	}
+#endif
+
+	// read from input_fd, inflate and convert utf16 according to input_filter
+	// store up to len bytes in ptr (needs len bytes of room even if utf16 halves the result)
+	// return the length of the converted data, 0 only at end of input or when zsplit gets set
+	unsigned decode_input ( char *ptr, unsigned len )
+	{
+		unsigned align = ( input_filter ? 2 : 1 );
+		len -= len % align;
+		if ( len == 0 )
+			return 0;
+
+#ifndef NO_ZLIB
+		while ( zbuf && ! zsplit )
+		{
+			int ret;
+			unsigned got;
+
+			// decompress into ptr, an even number of bytes for utf16
+			zstream.next_out = (Bytef *)ptr;
+			zstream.avail_out = len;
+			do
+			{
+				// refill compressed data once it is all consumed
+				if ( zbuf_cur == zbuf_end )
+					zbuf_fill( 1 );
 
-				// decompress into buf
-				int ret;
-				zstream.next_out = (Bytef *)buf + buf_end;
-				zstream.avail_out = toread;
 				zstream.next_in = (Bytef *)zbuf + zbuf_cur;
 				zstream.avail_in = zbuf_end - zbuf_cur;
 				ret = inflate( &zstream, Z_NO_FLUSH );
-				if ( ret == Z_OK || ret == Z_STREAM_END )
+				zbuf_cur = (char *)zstream.next_in - zbuf;
+				got = (char *)zstream.next_out - ptr;
+
+				if ( ret == Z_BUF_ERROR && ! input_at_eof )
+					// need more compressed input
+					ret = Z_OK;
+				else if ( ret == Z_STREAM_END && next_member() )
+					ret = Z_OK;
+			} while ( ret == Z_OK && got % align && ! zsplit );
+
+			if ( ret != Z_OK )
+			{
+				if ( ret != Z_STREAM_END && ! input_aborted )
+					std::cerr << "inflate: " << ( zstream.msg ? zstream.msg : "truncated input" ) << std::endl;
+
+				inflateEnd( &zstream );
+				delete[] zbuf;
+				zbuf = NULL;
+			}
+
+			if ( got > 0 )
+				return filter_input( ptr, got );
+		}
+
+		if ( zsplit )
+			return 0;
+#endif
+
+		return filter_input( ptr, read_input( ptr, len, align ) );
+	}
+
+#ifndef NO_ZLIB
+	// bgzf read-ahead: move whole members from zbuf to the slot, up to block_size of inflated data
+	// resets zsplit when a plain gzip member or a truncated member follows
+	// return false if no member was queued
+	bool ra_batch_bgzf ( ra_slot *s )
+	{
+		unsigned out = 0;
+
+		s->zlen = 0;
+
+		for (;;)
+		{
+			zbuf_fill( 18 );
+			if ( zbuf_cur == zbuf_end || ! zbuf_at_member() )
+				break;
+
+			unsigned size = bgzf_member_size( zbuf + zbuf_cur, zbuf_end - zbuf_cur );
+			if ( size == 0 )
+			{
+				// leave it to zstream, which was reset in next_member()
+				zsplit = false;
+				break;
+			}
+
+			if ( ! zbuf_fill( size ) )
+			{
+				// truncated input: zstream inflates what it can of the last member, and reports the error
+				zsplit = false;
+				break;
+			}
+
+			// isize, from the gzip trailer
+			const unsigned char *t = (const unsigned char *)zbuf + zbuf_cur + size - 4;
+			unsigned isize = t[0] | t[1] << 8 | t[2] << 16 | (unsigned)t[3] << 24;
+			if ( isize > BGZF_MAX_BLOCK )
+			{
+				std::cerr << "inflate: invalid bgzf block" << std::endl;
+				zbuf_cur = zbuf_end;
+				input_at_eof = true;
+				break;
+			}
+
+			if ( out + isize > block_size || s->zlen + size > block_size )
+				break;
+
+			memcpy( s->zdata + s->zlen, zbuf + zbuf_cur, size );
+			s->zlen += size;
+			zbuf_cur += size;
+			out += isize;
+		}
+
+		return s->zlen > 0;
+	}
+#endif
+
+	// read-ahead thread main loop: fill blocks until end of input or ra->stop
+	void ra_run ( )
+	{
+		unsigned tail = 0;
+
+		for (;;)
+		{
+			pthread_mutex_lock( &ra->lock );
+			while ( ra->count == ra->nblocks && ! ra->stop )
+				pthread_cond_wait( &ra->cond, &ra->lock );
+			bool stop = ra->stop;
+			pthread_mutex_unlock( &ra->lock );
+
+			if ( stop )
+				return;
+
+			ra_slot *s = &ra->slot[ tail ];
+			unsigned len = 0;
+			bool todo = false;
+
+#ifndef NO_ZLIB
+			if ( zsplit )
+				todo = ra_batch_bgzf( s );
+
+			if ( ! todo && ! zsplit )
+			{
+				len = decode_input( s->data, block_size );
+				if ( len == 0 && zsplit )
+					continue;
+			}
+#else
+			len = decode_input( s->data, block_size );
+#endif
+
+			pthread_mutex_lock( &ra->lock );
+			s->len = len;
+			s->last = ( len == 0 && ! todo );
+			s->state = ( todo ? RA_TODO : RA_READY );
+			++ra->count;
+			pthread_cond_broadcast( &ra->cond );
+			pthread_mutex_unlock( &ra->lock );
+
+			if ( s->last )
+				return;
+
+			tail = ( tail + 1 ) % ra->nblocks;
+		}
+	}
+
+	static void *ra_thread ( void *arg )
+	{
+		((line_reader *)arg)->ra_run();
+		return NULL;
+	}
+
+#ifndef NO_ZLIB
+	// worker thread main loop: inflate the members of RA_TODO slots
+	void ra_work ( )
+	{
+		z_stream zs;
+		zs.zalloc = Z_NULL;
+		zs.zfree = Z_NULL;
+		zs.opaque = Z_NULL;
+		zs.avail_in = 0;
+		zs.next_in = Z_NULL;
+		if ( inflateInit2( &zs, 16|15 ) != Z_OK )
+			return;
+
+		pthread_mutex_lock( &ra->lock );
+		for (;;)
+		{
+			ra_slot *s = NULL;
+			while ( ! ra->stop )
+			{
+				for ( unsigned i = 0 ; i < ra->count && ! s ; ++i )
+					if ( ra->slot[ ( ra->head + i ) % ra->nblocks ].state == RA_TODO )
+						s = &ra->slot[ ( ra->head + i ) % ra->nblocks ];
+				if ( s )
+					break;
+				pthread_cond_wait( &ra->cond, &ra->lock );
+			}
+			if ( ra->stop )
+				break;
+
+			s->state = RA_BUSY;
+			pthread_mutex_unlock( &ra->lock );
+
+			unsigned len = 0;
+			bool ok = true;
+			for ( unsigned off = 0 ; off < s->zlen && ok ; )
+			{
+				unsigned size = bgzf_member_size( s->zdata + off, s->zlen - off );
+
+				inflateReset( &zs );
+				zs.next_in = (Bytef *)s->zdata + off;
+				zs.avail_in = size;
+				zs.next_out = (Bytef *)s->data + len;
+				zs.avail_out = block_size - len;
+				if ( inflate( &zs, Z_FINISH ) != Z_STREAM_END )
 				{
-					zbuf_cur = (char *)zstream.next_in - zbuf;
-					buf_end = (char *)zstream.next_out - buf;
+					std::cerr << "inflate: " << ( zs.msg ? zs.msg : "invalid bgzf block" ) << std::endl;
+					ok = false;
 				}
 
-				if ( ret != Z_OK )
+				len = (char *)zs.next_out - s->data;
+				off += size;
+			}
+
+			pthread_mutex_lock( &ra->lock );
+			s->len = len;
+			s->last = ! ok;
+			s->state = RA_READY;
+			pthread_cond_broadcast( &ra->cond );
+		}
+		pthread_mutex_unlock( &ra->lock );
+
+		inflateEnd( &zs );
+	}
+
+	static void *ra_worker_thread ( void *arg )
+	{
+		((line_reader *)arg)->ra_work();
+		return NULL;
+	}
+#endif
+
+	// start the read-ahead thread, once input detection is done
+	// with threads > 1 and a gzip input, also start threads workers to inflate bgzf members
+	void init_read_ahead ( unsigned threads )
+	{
+		ra = new read_ahead;
+		pthread_mutex_init( &ra->lock, NULL );
+		pthread_cond_init( &ra->cond, NULL );
+		ra->workers = NULL;
+		ra->nworkers = 0;
+		ra->head = ra->count = ra->head_cur = 0;
+		ra->stop = ra->eof = false;
+
+		unsigned nworkers = 0;
+#ifndef NO_ZLIB
+		if ( zbuf && ! input_filter && block_size >= BGZF_MAX_BLOCK )
+			nworkers = threads;
+#else
+		(void)threads;
+#endif
+
+		ra->nblocks = RA_BLOCKS + nworkers;
+		ra->slot = new ra_slot[ ra->nblocks ];
+		for ( unsigned i = 0 ; i < ra->nblocks ; ++i )
+		{
+			ra->slot[ i ].data = new char[ block_size ];
+			ra->slot[ i ].zdata = ( nworkers ? new char[ block_size ] : NULL );
+			ra->slot[ i ].state = RA_FREE;
+		}
+
+#ifndef NO_ZLIB
+		if ( nworkers )
+		{
+			ra->workers = new pthread_t[ nworkers ];
+			while ( ra->nworkers < nworkers && ! pthread_create( &ra->workers[ ra->nworkers ], NULL, ra_worker_thread, this ) )
+				++ra->nworkers;
+		}
+#endif
+
+		if ( pthread_create( &ra->thread, NULL, ra_thread, this ) )
+		{
+			std::cerr << "Cannot start read-ahead thread: " << strerror( errno ) << std::endl;
+			stop_workers();
+			free_read_ahead();
+		}
+	}
+
+	void stop_workers ( )
+	{
+		pthread_mutex_lock( &ra->lock );
+		ra->stop = true;
+		pthread_cond_broadcast( &ra->cond );
+		pthread_mutex_unlock( &ra->lock );
+
+		for ( unsigned i = 0 ; i < ra->nworkers ; ++i )
+			pthread_join( ra->workers[ i ], NULL );
+	}
+
+	// stop the read-ahead threads, free its blocks
+	void stop_read_ahead ( )
+	{
+		stop_workers();
+		pthread_join( ra->thread, NULL );
+
+		free_read_ahead();
+	}
+
+	void free_read_ahead ( )
+	{
+		for ( unsigned i = 0 ; i < ra->nblocks ; ++i )
+		{
+			delete[] ra->slot[ i ].data;
+			delete[] ra->slot[ i ].zdata;
+		}
+		delete[] ra->slot;
+		delete[] ra->workers;
+		pthread_cond_destroy( &ra->cond );
+		pthread_mutex_destroy( &ra->lock );
+		delete ra;
+		ra = NULL;
+	}
+
+	// copy data from the read-ahead blocks into buf, up to buf_size
+	// only waits for the threads if nothing could be copied
+	void ra_fill ( )
+	{
+		bool copied = false;
+
+		while ( buf_end < buf_size && ! ra->eof )
+		{
+			ra_slot *s = &ra->slot[ ra->head ];
+
+			pthread_mutex_lock( &ra->lock );
+			while ( ( ra->count == 0 || s->state != RA_READY ) && ! copied )
+			{
+				unsigned ms = ~0U;
+				if ( idle_fn )
 				{
-					if ( ret == Z_STREAM_END )
-					{
-						if ( zbuf_cur != zbuf_end )
-							std::cerr << "inflate: trailing data (" << (zbuf_end - zbuf_cur) << " bytes)" << std::endl;
-					} else
-						std::cerr << "inflate: " << zstream.msg << std::endl;
-
-					inflateEnd( &zstream );
-					delete[] zbuf;
-					zbuf = NULL;
+					pthread_mutex_unlock( &ra->lock );
+					ms = idle_fn( idle_arg );
+					pthread_mutex_lock( &ra->lock );
+					if ( ra->count > 0 && s->state == RA_READY )
+						break;
 				}
 
-				if ( input_filter )
-					buf_end = filter_input( old_end, buf_end );
+				if ( ms == ~0U )
+					pthread_cond_wait( &ra->cond, &ra->lock );
+				else
+				{
+					struct timespec ts;
+					clock_gettime( CLOCK_REALTIME, &ts );
+					ts.tv_sec += ms / 1000;
+					ts.tv_nsec += ( ms % 1000 ) * 1000000L;
+					if ( ts.tv_nsec >= 1000000000L )
+					{
+						++ts.tv_sec;
+						ts.tv_nsec -= 1000000000L;
+					}
+					pthread_cond_timedwait( &ra->cond, &ra->lock, &ts );
+				}
+			}
+			bool ready = ( ra->count > 0 && s->state == RA_READY );
+			pthread_mutex_unlock( &ra->lock );
 
+			if ( ! ready )
 				return;
+
+			unsigned n = s->len - ra->head_cur;
+			if ( n > buf_size - buf_end )
+				n = buf_size - buf_end;
+
+			memcpy( buf + buf_end, s->data + ra->head_cur, n );
+			buf_end += n;
+			ra->head_cur += n;
+			copied = copied || n > 0;
+
+			if ( ra->head_cur == s->len )
+			{
+				if ( s->last )
+				{
+					ra->eof = true;
+					return;
+				}
+
+				// release block
+				pthread_mutex_lock( &ra->lock );
+				s->state = RA_FREE;
+				ra->head = ( ra->head + 1 ) % ra->nblocks;
+				ra->head_cur = 0;
+				--ra->count;
+				pthread_cond_broadcast( &ra->cond );
+				pthread_mutex_unlock( &ra->lock );
 			}
+		}
+	}
+
+	static off_t page_mask ( )
+	{
+		static const off_t mask = sysconf( _SC_PAGESIZE ) - 1;
+		return mask;
+	}
+
+	// return true if refill_buffer() would make room at the end of buf
+	bool can_refill ( ) const
+	{
+		if ( view )
+			return false;
+
+		if ( map_fd != -1 )
+			return ! input_eof() && (off_t)buf_cur > page_mask();
+
+		return buf_cur > 0 || ( buf_end + ( input_filter ? 2 : 1 ) <= buf_size && ! input_eof() );
+	}
+
+	// reallocate a bigger buf, up to line_max, when a line does not fit in the read block
+	// return false if buf cannot grow
+	bool grow_buffer ( )
+	{
+		if ( view || map_fd != -1 || buf_size >= line_max )
+			return false;
+
+		unsigned new_size = buf_size * 2;
+		if ( new_size <= buf_size || new_size > line_max )
+			new_size = line_max;
+
+		release();
+
+		char *new_buf = new char[new_size];
+		memcpy( new_buf, buf + buf_cur, buf_end - buf_cur );
+		delete[] buf;
+
+		buf = new_buf;
+		buf_end -= buf_cur;
+		buf_cur = 0;
+		buf_size = new_size;
+		eol_end = 0;
+
+		return true;
+	}
+
+	// map a new window starting at the page holding buf_cur
+	// return false if the window could not be mapped (buf is then empty)
+	bool remap_window ( )
+	{
+		off_t new_off = ( map_off + buf_cur ) & ~page_mask();
+		unsigned new_cur = map_off + buf_cur - new_off;
+
+		if ( buf )
+		{
+			release();
+			munmap( buf, buf_size );
+		}
+
+		buf = NULL;
+		buf_cur = buf_end = buf_size = 0;
+		map_off = new_off;
+
+		if ( file_size - map_off > MAP_WINDOW )
+			buf_size = MAP_WINDOW;
+		else
+			buf_size = file_size - map_off;
+
+		if ( buf_size == 0 )
+			return false;
+
+		// writable private mapping: some clients modify returned lines in place (eg csv-aggreg downcase)
+		void *ptr = mmap( NULL, buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, map_fd, map_off );
+		if ( ptr == MAP_FAILED )
+		{
+			std::cerr << "mmap: " << strerror( errno ) << std::endl;
+			buf_size = 0;
+			return false;
+		}
+		madvise( ptr, buf_size, MADV_SEQUENTIAL );
+
+		buf = (char *)ptr;
+		buf_cur = new_cur;
+		buf_end = buf_size;
+
+		return true;
+	}
+
+	// try to mmap a regular file
+	// return false if the file should be read through read() (not a regular file, compressed, utf16)
+	bool init_mmap ( int fd )
+	{
+		struct stat st;
+		unsigned char magic[ 2 ];
+
+		map_fd = fd;
+
+		if ( fstat( map_fd, &st ) || ! S_ISREG( st.st_mode ) || st.st_size == 0 ||
+				pread( map_fd, magic, 2, 0 ) != 2 ||
+				( magic[ 0 ] == 0x1f && magic[ 1 ] == 0x8b ) ||
+				( magic[ 0 ] == 0xfe && magic[ 1 ] == 0xff ) ||
+				( magic[ 0 ] == 0xff && magic[ 1 ] == 0xfe ) )
+		{
+			map_fd = -1;
+			return false;
+		}
+
+		file_size = st.st_size;
+
+		if ( ! remap_window() )
+		{
+			map_fd = -1;
+			return false;
+		}
+
+		if ( buf_end >= 3 && buf[0] == '\xef' && buf[1] == '\xbb' && buf[2] == '\xbf' )
+		{
+			// discard utf-8 BOM
+			buf_cur += 3;
+		}
+
+		return true;
+	}
+
+	// return true if all data from the input was loaded in buf
+	bool input_eof ( ) const
+	{
+		if ( view )
+			return true;
+
+		if ( map_fd != -1 )
+			return map_off + buf_end >= file_size;
+
+		if ( ra )
+			return ra->eof;
+
+#ifndef NO_ZLIB
+		// compressed data may still be pending in zbuf
+		if ( zbuf )
+			return false;
 #endif
 
-			input->read( buf + buf_end, toread );
-			buf_end += input->gcount();
-			if (buf_end > buf_size)
-				buf_end = buf_cur;	// just in case
+		return input_at_eof;
+	}
+
+	// memmove buf_cur to buf_start, fill buf_end..buf_size with freshly read data
+	// convert utf16 according to input_filter
+	// in mmap mode, slide the window so that it starts at buf_cur
+	void refill_buffer ( )
+	{
+		if ( view )
+			return;
+
+		if ( map_fd != -1 )
+		{
+			if ( can_refill() )
+				remap_window();
+
+			return;
+		}
+
+		if ( buf_cur > 0 )
+		{
+			if ( buf_end < buf_cur )
+				buf_end = buf_cur;
 
-			if ( input_filter )
-				buf_end = filter_input( old_end, buf_end );
+			release();
+			memmove( buf, buf + buf_cur, buf_end - buf_cur );
+			buf_end -= buf_cur;
+			buf_cur = 0;
+			eol_end = 0;
+		}
+
+		if ( buf_end < buf_size )
+		{
+			if ( ra )
+				ra_fill();
+			else
+				buf_end += decode_input( buf + buf_end, buf_size - buf_end );
 		}
 	}
 
@@ -204,7 +940,10 @@ public:
 	// return true if no more data is available from input
 	bool eos ( ) const
 	{
-		if ( input->good() )
+		if ( view && buf_cur >= view_limit )
+			return true;
+
+		if ( ! input_eof() )
 			return false;
 
 		if ( buf_cur < buf_end )
@@ -213,33 +952,61 @@ public:
 		return true;
 	}
 
-	explicit line_reader ( const char *filename, const unsigned line_max = 64*1024 ) :
-		should_delete_input(false),
+	// block_size is the size of the read buffer, it will grow up to line_max if needed by a long line
+	// with threads > 1, non-mmapped inputs are read and decompressed by a background thread
+	explicit line_reader ( const char *filename, const unsigned line_max = 64*1024, const unsigned block_size = 4*1024*1024, const unsigned threads = 1 ) :
+		input_fd(-1),
+		should_close_input(false),
+		input_at_eof(false),
+		input_aborted(false),
 		badfile(false),
 		buf_cur(0),
 		buf_end(0),
-		buf_size(line_max),
+		buf_size(block_size),
+		buf(NULL),
+		eol_end(0),
+		line_max(line_max),
+		block_size(block_size),
+		map_fd(-1),
+		map_off(0),
+		file_size(0),
+		view(false),
+		view_truncated(false),
+		view_limit(0),
+		quiet(false),
+		line_error(false),
 #ifndef NO_ZLIB
 		zbuf(NULL),
+		zsplit(false),
 #endif
-		input_filter(0)
+		input_filter(0),
+		ra(NULL),
+		release_fn(NULL),
+		release_arg(NULL),
+		idle_fn(NULL),
+		idle_arg(NULL)
 	{
-		buf = new char[buf_size];
-
 		if ( filename && filename[ 0 ] == '-' && filename[ 1 ] == 0 )
 		{
-			input = &std::cin;
+			input_fd = 0;
 		}
 		else if ( filename )
 		{
-			should_delete_input = true;
-			input = new std::ifstream(filename);
-			if ( ! *input )
+			input_fd = open( filename, O_RDONLY );
+			if ( input_fd == -1 )
 			{
 				std::cerr << "Cannot open " << filename << ": " << strerror( errno ) << std::endl;
 				badfile = true;
 				return;
 			}
+
+			if ( init_mmap( input_fd ) )
+			{
+				input_fd = -1;
+				return;
+			}
+
+			should_close_input = true;
 		}
 		else if ( isatty( 0 ) )
 		{
@@ -249,11 +1016,16 @@ public:
 		}
 		else
 		{
-			input = &std::cin;
+			input_fd = 0;
 		}
 
-		input->read( buf, (buf_size > 4096 ? buf_size/16 : buf_size) );
-		buf_end = input->gcount();
+		buf_size = block_size;
+		buf = new char[buf_size];
+
+		// read enough data to detect the input format
+		unsigned want = (buf_size > 4096 ? buf_size/16 : buf_size);
+		while ( buf_end < 3 && buf_end < want && ! input_at_eof )
+			buf_end += read_input( buf + buf_end, want - buf_end );
 
 #ifndef NO_ZLIB
 		if ( buf_end >= 2 && buf[0] == 0x1f && buf[1] == (char)0x8b )
@@ -266,34 +1038,142 @@ public:
 			// discard utf-8 BOM
 			buf_cur += 3;
 		}
-		else if ( buf_end >= 2 && buf[0] == '\xfe' && buf[1] == '\xff')
+		else if ( buf_end >= 2 && ( ( buf[0] == '\xfe' && buf[1] == '\xff' ) || ( buf[0] == '\xff' && buf[1] == '\xfe' ) ) )
 		{
-			// utf-16be BOM
+			// utf-16 BOM, convert an even number of bytes
 			buf_cur += 2;
-			input_filter = INPUT_FILTER_UTF16BE;
-			buf_end = filter_input( buf_cur, buf_end );
-		}
-		else if ( buf_end >= 2 && buf[0] == '\xff' && buf[1] == '\xfe')
-		{
-			// utf-16le BOM
-			buf_cur += 2;
-			input_filter = INPUT_FILTER_UTF16LE;
-			buf_end = filter_input( buf_cur, buf_end );
+			if ( ( buf_end - buf_cur ) & 1 )
+			{
+				if ( buf_end < buf_size )
+					buf_end += decode_input( buf + buf_end, 1 );
+				else
+					--buf_end;
+			}
+
+			input_filter = ( buf[0] == '\xfe' ? INPUT_FILTER_UTF16BE : INPUT_FILTER_UTF16LE );
+			buf_end = buf_cur + filter_input( buf + buf_cur, buf_end - buf_cur );
 		}
+
+		if ( threads > 1 && ! badfile )
+			init_read_ahead( threads );
+	}
+
+	// view mode: read lines from ptr[0..len), up to the first line starting at or after limit
+	// truncated: more input follows len, so a line reaching len is too long
+	// quiet: line errors are not reported, only flagged for had_error()
+	line_reader ( char *ptr, const unsigned len, const unsigned limit, const bool truncated, const unsigned line_max, const bool quiet ) :
+		input_fd(-1),
+		should_close_input(false),
+		input_at_eof(true),
+		input_aborted(false),
+		badfile(false),
+		buf_cur(0),
+		buf_end(len),
+		buf_size(len),
+		buf(ptr),
+		eol_end(0),
+		line_max(line_max),
+		block_size(len),
+		map_fd(-1),
+		map_off(0),
+		file_size(0),
+		view(true),
+		view_truncated(truncated),
+		view_limit(limit),
+		quiet(quiet),
+		line_error(false),
+#ifndef NO_ZLIB
+		zbuf(NULL),
+		zsplit(false),
+#endif
+		input_filter(0),
+		ra(NULL),
+		release_fn(NULL),
+		release_arg(NULL),
+		idle_fn(NULL),
+		idle_arg(NULL)
+	{
 	}
 
 	~line_reader ( )
 	{
-		if ( should_delete_input )
-			delete input;
+		release();
 
-		delete[] buf;
+		if ( ra )
+			stop_read_ahead();
+
+		if ( should_close_input )
+			close( input_fd );
+
+		if ( map_fd != -1 )
+		{
+			if ( buf )
+				munmap( buf, buf_size );
+			close( map_fd );
+		}
+		else if ( ! view )
+			delete[] buf;
 #ifndef NO_ZLIB
 		if ( zbuf )
+		{
+			inflateEnd( &zstream );
 			delete[] zbuf;
+		}
 #endif
 	}
 
+	// find the end of the line starting at buf_cur, its first skip bytes are known to hold no newline
+	// slides / refills / grows buf as needed, keeping the data from buf_cur
+	// return the line length including the newline, 0 if no data is available after skip at end of input,
+	// -1 if the line is longer than line_max or does not fit in buf
+	int find_line ( unsigned skip )
+	{
+		unsigned scanned = skip;
+
+		for (;;)
+		{
+			char *nl = NULL;
+
+			if ( buf_cur + scanned < buf_end )
+				nl = (char*)memchr( (void*)(buf + buf_cur + scanned), '\n', buf_end - buf_cur - scanned );
+
+			// newline found ?
+			if ( nl )
+			{
+				unsigned len = nl + 1 - ( buf + buf_cur );
+
+				// buf may be larger than line_max
+				return ( len > line_max ? -1 : (int)len );
+			}
+
+			scanned = buf_end - buf_cur;
+
+			// slide existing buffer, read more from input, and retry
+			if ( can_refill() )
+				refill_buffer();
+
+			// end of file ? (eof is considered as a newline)
+			else if ( input_eof() )
+			{
+				if ( view_truncated )
+					return -1;
+
+				if ( scanned <= skip )
+					return 0;
+
+				return ( scanned > line_max ? -1 : (int)scanned );
+			}
+
+			// buffer full: grow it if the line may still fit in line_max
+			else if ( grow_buffer() )
+				refill_buffer();
+
+			// no newline in whole buffer / mmap window
+			else
+				return -1;
+		}
+	}
+
 	// read one line from input, starting at buf_cur
 	// returns the line start in line_start and the line length in line_length
 	// line_length includes the newline character(s)
@@ -304,65 +1184,174 @@ public:
 	// the returned pointer is only valid until the next call to read_line
 	bool read_line ( char* *line_start, unsigned *line_length )
 	{
-		char *nl = NULL;
-
-		if ( buf_cur < buf_end )
-			nl = (char*)memchr( (void*)(buf + buf_cur), '\n', buf_end - buf_cur );
+		int len = ( view && buf_cur >= view_limit ? 0 : find_line( 0 ) );
 
-		// newline found ?
-		if ( nl )
+		if ( len > 0 )
 		{
 			*line_start = buf + buf_cur;
-			*line_length = nl + 1 - *line_start;
-
-			buf_cur += *line_length;
-			if (buf_cur > buf_end)
-				buf_cur = buf_end;	// just in case
+			*line_length = len;
+			buf_cur += len;
 
 			return true;
 		}
 
-		// slide existing buffer, read more from input, and retry
-		if ( buf_cur > 0 )
+		*line_start = NULL;
+		*line_length = 0;
+
+		if ( len < 0 )
 		{
-			refill_buffer();
+			std::string sample( buf + buf_cur, ( buf_end - buf_cur > 64 ? 64 : buf_end - buf_cur ) );
+			if ( ! quiet )
+				std::cerr << "Line too long, near '" << sample << "'" << std::endl;
+			line_error = true;
 
-			return read_line( line_start, line_length );
+			// skip buffered data, to avoid infinite loop in badly written clients
+			buf_cur = buf_end;
 		}
 
-		// end of file ?
-		if ( !input->good() )
+		return false;
+	}
+
+	// extend the last line returned by read_line() or continue_line() up to the end of the next input line
+	// lines are contiguous in buf, so the result is the previous line directly followed by the next one
+	// line_start is updated as buf may have moved, even on failure (line_length is then unchanged)
+	// returns false at end of input, or if the result would be longer than line_max
+	bool continue_line ( char* *line_start, unsigned *line_length )
+	{
+		buf_cur -= *line_length;
+
+		int len = find_line( *line_length );
+
+		*line_start = buf + buf_cur;
+
+		if ( len > 0 )
 		{
-			if ( buf_cur < buf_end )
-			{
-				*line_start = buf + buf_cur;
-				*line_length = buf_end - buf_cur;
-				buf_cur = buf_end;
+			*line_length = len;
+			buf_cur += len;
 
-				return true;
-			}
-			else
-			{
-				*line_start = NULL;
-				*line_length = 0;
+			return true;
+		}
 
-				return false;
+		if ( len < 0 )
+		{
+			std::string sample( buf + buf_cur, ( *line_length > 64 ? 64 : *line_length ) );
+			if ( ! quiet )
+				std::cerr << "Csv row too long (maybe unclosed quote?) near '" << sample << "'" << std::endl;
+			line_error = true;
+		}
+
+		buf_cur += *line_length;
+
+		return false;
+	}
+
+	// return false if the next line may have to wait for input, and the idle hook be called: the input is a pipe or
+	// socket without a line end in the buffered data
+	// a \r at buf_end is not a sure line end: the next byte tells a crlf from a lone \r
+	// only the first line of a row is checked, a row with a multi-line quoted field may still wait in extend_row()
+	bool line_buffered ( )
+	{
+		if ( ! idle_fn || map_fd != -1 || view || input_at_eof || eol_end > buf_cur )
+			return true;
+
+		// from the end: the data read usually ends with a line
+		for ( const char *p = buf + buf_end ; p > buf + buf_cur ; )
+		{
+			--p;
+			if ( *p == '\n' || ( *p == '\r' && p + 1 < buf + buf_end ) )
+			{
+				eol_end = p + 1 - buf;
+				return true;
 			}
 		}
 
-		// no newline in whole buffer
-		*line_start = NULL;
-		*line_length = 0;
+		return false;
+	}
+
+	// return true if a line or row was longer than line_max
+	bool had_error ( ) const
+	{
+		return line_error;
+	}
+
+	bool is_quiet ( ) const
+	{
+		return quiet;
+	}
+
+	// offset in buf of the next line, for view mode
+	unsigned offset ( ) const
+	{
+		return buf_cur;
+	}
+
+	// mmap mode: return the input file descriptor and size, and the file offset of ptr (a line in the current window)
+	// return false for other inputs
+	bool map_position ( const char *ptr, int *fd, off_t *offset, off_t *size ) const
+	{
+		if ( map_fd == -1 )
+			return false;
+
+		*fd = map_fd;
+		*offset = map_off + ( ptr - buf );
+		*size = file_size;
+
+		return true;
+	}
+
+	// fn( arg ) is called before the lines returned so far are overwritten or unmapped
+	void set_release_hook ( void (*fn)( void *arg ), void *arg )
+	{
+		release_fn = fn;
+		release_arg = arg;
+	}
+
+	// fn( arg ) is called when the input has no data ready, see csv_reader::set_idle_hook()
+	void set_idle_hook ( unsigned (*fn)( void *arg ), void *arg )
+	{
+		idle_fn = fn;
+		idle_arg = arg;
+	}
+
+	// return true if the lines are in a file mapping, never modified unless the client does
+	bool lines_mapped ( ) const
+	{
+		return map_fd != -1;
+	}
+
+	// hand the rest of the input, from from (a line in buf), over to the caller: the buffered data in data / len,
+	// followed by the data of fd from offset (-1: from its current position)
+	// the reader is left at end of input
+	// return false if the input is not read as is (compressed, utf16, read-ahead thread, view mode)
+	bool take_input ( const char *from, char* *data, unsigned *len, int *fd, off_t *offset )
+	{
+		if ( view || ra || input_filter )
+			return false;
+#ifndef NO_ZLIB
+		if ( zbuf )
+			return false;
+#endif
 
-		std::string sample( buf, (buf_end > 64 ? 64 : buf_end) );
-		std::cerr << "Line too long, near '" << sample << "'" << std::endl;
+		if ( map_fd != -1 )
+		{
+			*data = NULL;
+			*len = 0;
+			*fd = map_fd;
+			*offset = map_off + ( from - buf );
+			file_size = map_off + buf_end;
+		}
+		else
+		{
+			*data = (char *)from;
+			*len = buf + buf_end - from;
+			*fd = input_fd;
+			*offset = -1;
+			input_at_eof = true;
+		}
 
-		// slide buffer anyway, to avoid infinite loop in badly written clients
-		buf_cur = 0;
-		buf_end = 0;
-		refill_buffer();
+		buf_cur = buf_end;
 
-		return false;
+		return true;
 	}
 
 	// read raw data (dont mix with read_line)
@@ -383,6 +1372,10 @@ private:
 	line_reader& operator=( const line_reader& );
 };
 
+// the separator and quote chars of a parser specialization: the template parameter, or the runtime member if it is -1
+#define SEP_CHAR ( SEP < 0 ? this->sep : (char)SEP )
+#define QUOT_CHAR ( QUOT < 0 ? this->quot : (char)QUOT )
+
 // set cur_line_length from cur_line_length_nl, trim \r\n
 void csv_reader::trim_newlines ( )
 {
@@ -419,31 +1412,185 @@ bool csv_reader::eos ( ) const
 void csv_reader::reset_cur_field_offset ( )
 {
 	cur_field_offset = 0;
+	field_idx = 0;
 }
 
 // line_max is passed to the line_reader, it is also the limit for a full csv row (that may span many lines)
-csv_reader::csv_reader ( const char *filename, const char sep, const char quot, const unsigned line_max ) :
+csv_reader::csv_reader ( const char *filename, const char sep, const char quot, const unsigned line_max, const unsigned block_size, const unsigned threads ) :
+	line_max(line_max),
+	failed(false),
+	sep(sep),
+	quot(quot),
+	cur_line(NULL),
+	cur_line_length(0),
+	cur_line_length_nl(0),
+	cur_field_offset(1),
+	cur_line_final(false),
+	batch_fetch_pending(false),
+	field_seps(NULL),
+	field_seps_size(0),
+	field_seps_count(INDEX_NONE),
+	field_idx(0),
+	index_partial(false),
+	arena(NULL),
+	arena_used(0),
+	arena_size(0)
+{
+	input_lines = new line_reader(filename, line_max, block_size, threads);
+
+	select_parser();
+}
+
+// use a parser specialized for the separator and quote chars if available, so that they are constants in the hot loops
+void csv_reader::select_parser ( )
+{
+	if ( quot == '"' && sep == ',' )
+	{
+		read_field_fn = &csv_reader::read_field<',', '"'>;
+		read_batch_fn = &csv_reader::read_batch_rows<',', '"'>;
+		skip_fields_fn = &csv_reader::skip_fields<',', '"'>;
+	}
+	else if ( quot == '"' && sep == ';' )
+	{
+		read_field_fn = &csv_reader::read_field<';', '"'>;
+		read_batch_fn = &csv_reader::read_batch_rows<';', '"'>;
+		skip_fields_fn = &csv_reader::skip_fields<';', '"'>;
+	}
+	else if ( quot == '"' && sep == '\t' )
+	{
+		read_field_fn = &csv_reader::read_field<'\t', '"'>;
+		read_batch_fn = &csv_reader::read_batch_rows<'\t', '"'>;
+		skip_fields_fn = &csv_reader::skip_fields<'\t', '"'>;
+	}
+	else if ( quot == '"' && sep == '|' )
+	{
+		read_field_fn = &csv_reader::read_field<'|', '"'>;
+		read_batch_fn = &csv_reader::read_batch_rows<'|', '"'>;
+		skip_fields_fn = &csv_reader::skip_fields<'|', '"'>;
+	}
+	else
+	{
+		read_field_fn = &csv_reader::read_field<-1, -1>;
+		read_batch_fn = &csv_reader::read_batch_rows<-1, -1>;
+		skip_fields_fn = &csv_reader::skip_fields<-1, -1>;
+	}
+}
+
+// parse the rows of a memory area, see csv_parallel
+csv_reader::csv_reader ( char *ptr, const unsigned len, const unsigned limit, const bool truncated, const char sep, const char quot, const unsigned line_max, const bool quiet ) :
 	line_max(line_max),
-	line_copy(NULL),
 	failed(false),
 	sep(sep),
 	quot(quot),
 	cur_line(NULL),
 	cur_line_length(0),
 	cur_line_length_nl(0),
-	cur_field_offset(1)
+	cur_field_offset(1),
+	cur_line_final(false),
+	batch_fetch_pending(false),
+	field_seps(NULL),
+	field_seps_size(0),
+	field_seps_count(INDEX_NONE),
+	field_idx(0),
+	index_partial(false),
+	arena(NULL),
+	arena_used(0),
+	arena_size(0)
 {
-	input_lines = new line_reader(filename, line_max);
+	input_lines = new line_reader(ptr, len, limit, truncated, line_max, quiet);
+
+	select_parser();
 }
 
 csv_reader::~csv_reader ( )
 {
-	if ( line_copy )
-		delete[] line_copy;
+	delete[] field_seps;
+
+	for ( unsigned i = 0 ; i < arena_full.size() ; ++i )
+		delete[] arena_full[ i ];
+	delete[] arena;
 
 	delete input_lines;
 }
 
+// append the next input line to the current row, for a quoted field spanning lines
+// return false if the row cannot be extended (end of input, row longer than line_max)
+bool csv_reader::extend_row ( )
+{
+	if ( cur_line_final )
+		return false;
+
+	if ( ! input_lines->continue_line( &cur_line, &cur_line_length_nl ) )
+	{
+		cur_line_final = true;
+		return false;
+	}
+
+	trim_newlines();
+
+	return true;
+}
+
+// compute field_seps for cur_line, until more than want separators are found or up to the row end
+// resumes a partial index
+template <int SEP, int QUOT>
+void csv_reader::index_line ( unsigned want )
+{
+	const char sep = SEP_CHAR;
+	const char quot = QUOT_CHAR;
+
+	if ( field_seps_count == INDEX_NONE )
+	{
+		csv_index_init( &index_st );
+		field_idx = 0;
+	}
+
+	int ret;
+	for (;;)
+	{
+		if ( cur_line_length > field_seps_size )
+		{
+			unsigned new_size = ( field_seps_size ? field_seps_size : 256 );
+			while ( new_size < cur_line_length )
+				new_size *= 2;
+
+			unsigned *new_seps = new unsigned[new_size];
+			if ( field_seps )
+				memcpy( new_seps, field_seps, index_st.n * sizeof(*field_seps) );
+			delete[] field_seps;
+
+			field_seps = new_seps;
+			field_seps_size = new_size;
+		}
+
+		ret = csv_index_resume( cur_line, cur_line_length, sep, quot, field_seps, &index_st, want );
+
+		if ( ret != CSV_INDEX_OPEN )
+			break;
+
+		// quoted field spanning lines: extend the row, until a line may close the field
+		bool extended;
+		do
+		{
+			unsigned prev_length = cur_line_length;
+			extended = extend_row();
+			if ( extended && memchr( cur_line + prev_length, quot, cur_line_length - prev_length ) )
+				break;
+		} while ( extended );
+
+		if ( ! extended )
+			break;
+	}
+
+	index_partial = ( ret == CSV_INDEX_PARTIAL );
+	if ( index_partial )
+		field_seps_count = index_st.n;
+	else if ( ret < 0 )
+		field_seps_count = -1;
+	else
+		field_seps_count = ret;
+}
+
 // read one line from input_lines
 // invalidates previous read_csv_field pointers
 // return false after EOF
@@ -455,8 +1602,19 @@ bool csv_reader::fetch_line ( )
 	if ( input_lines->read_line( &cur_line, &cur_line_length_nl ) )
 	{
 		cur_field_offset = 0;
+		cur_line_final = false;
+		field_seps_count = INDEX_NONE;
+		index_partial = false;
 		trim_newlines();
 
+		arena_used = 0;
+		if ( ! arena_full.empty() )
+		{
+			for ( unsigned i = 0 ; i < arena_full.size() ; ++i )
+				delete[] arena_full[ i ];
+			arena_full.clear();
+		}
+
 		return true;
 	}
 
@@ -470,18 +1628,38 @@ bool csv_reader::fetch_line ( )
 // read one csv field from the current line
 // returns false if no more fields are available in the line, or if there is a syntax error (unterminated quote, end quote followed by neither a quote nor a separator)
 // returns a pointer to the line start, the offset of the current field, and its length
-// the 'field_offset' returned by previous calls for the same line is still valid relative to the new 'line_start' (which may change if one field crosses a line boundary, in that case the lines are copied into an internal buffer)
-bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, unsigned *field_length )
+// the 'field_offset' returned by previous calls for the same line is still valid relative to the new 'line_start' (which may change if one field crosses a line boundary, in that case the row is extended in place in the input buffer, which may move)
+template <int SEP, int QUOT>
+bool csv_reader::read_field ( char* *line_start, unsigned *field_offset, unsigned *field_length )
 {
+	const char sep = SEP_CHAR;
+	const char quot = QUOT_CHAR;
+
 	if ( failed )
 		return false;
 
 	if ( cur_field_offset > cur_line_length )
 		return false;
 
+	// may extend the row, and move cur_line
+	if ( field_seps_count == INDEX_NONE || ( index_partial && field_idx >= (unsigned)field_seps_count ) )
+		index_line<SEP, QUOT>( field_idx );
+
 	*field_offset = cur_field_offset;
 	*line_start = cur_line;
 
+	if ( field_seps_count >= 0 )
+	{
+		// the field ends at the next indexed separator
+		unsigned end = ( field_idx < (unsigned)field_seps_count ? field_seps[ field_idx ] : cur_line_length );
+		++field_idx;
+
+		*field_length = end - cur_field_offset;
+		cur_field_offset = end + 1;
+
+		return true;
+	}
+
 	if ( cur_field_offset == cur_line_length )
 	{
 		// line ends in a coma
@@ -541,8 +1719,8 @@ bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, uns
 					continue;
 				}
 
-				// syntax error
-				cur_field_offset += *field_length;
+				// syntax error, the rest of the row is ignored
+				cur_field_offset = cur_line_length + 1;
 				return false;
 			}
 
@@ -551,44 +1729,18 @@ bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, uns
 			return true;
 		}
 
-		// no closing quote on current input_lines line
-		if ( cur_line != line_copy )
-		{
-			// copy current line to internal buffer
-			if ( !line_copy )
-				line_copy = new char[line_max];
-
-			memcpy( line_copy, cur_line, cur_line_length_nl );
-
-			*line_start = cur_line = line_copy;
-		}
-
-		char *next_line = NULL;
-		unsigned next_line_length_nl = 0;
+		// no closing quote on current input_lines line: append the next line to the row
+		unsigned prev_length_nl = cur_line_length_nl;
 
-		input_lines->read_line( &next_line, &next_line_length_nl );
-
-		if ( next_line && cur_line_length_nl + next_line_length_nl <= line_max )
+		if ( extend_row() )
 		{
-			// next line fits in internal buffer: append
-			memcpy( line_copy + cur_line_length_nl, next_line, next_line_length_nl );
-
-			*field_length = cur_line_length_nl - cur_field_offset;
-
-			cur_line_length_nl += next_line_length_nl;
-
-			trim_newlines();
+			*line_start = cur_line;
+			*field_length = prev_length_nl - cur_field_offset;
 		}
 		else
 		{
 			// reached end of input_lines / line_max with no end quote: return syntax error
-			if ( next_line )
-			{
-				std::string sample( cur_line, 64 );
-				std::cerr << "Csv row too long (maybe unclosed quote?) near '" << sample << "'" << std::endl;
-			}
-
-			if ( ! input_lines->eos() )
+			if ( ! input_lines->eos() && ! input_lines->is_quiet() )
 				std::cerr << "Ignoring end of file" << std::endl;
 
 			failed = true;
@@ -598,6 +1750,11 @@ bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, uns
 	}
 }
 
+bool csv_reader::read_csv_field ( char* *line_start, unsigned *field_offset, unsigned *field_length )
+{
+	return (this->*read_field_fn)( line_start, field_offset, field_length );
+}
+
 // same as read_csv_field ( line_start, field_offset, field_length ) with simpler args
 // returned values are only valid until the next call to this function (with the 3-args version, it is valid until fetch_line())
 bool csv_reader::read_csv_field ( char* *field_start, unsigned *field_length )
@@ -605,7 +1762,7 @@ bool csv_reader::read_csv_field ( char* *field_start, unsigned *field_length )
 	char *line_start = NULL;
 	unsigned field_offset = 0;
 
-	if ( ! read_csv_field( &line_start, &field_offset, field_length ) )
+	if ( ! (this->*read_field_fn)( &line_start, &field_offset, field_length ) )
 		return false;
 
 	*field_start = line_start + field_offset;
@@ -664,6 +1821,68 @@ std::string* csv_reader::unescape_csv_field ( char* *field_start, unsigned *fiel
 	}
 }
 
+// return room for len bytes in the arena
+// a full block is kept until the next row, as fields may point to it, the new block is larger so that
+// a single block holds a row after a few rows
+char *csv_reader::arena_alloc ( unsigned len )
+{
+	if ( arena_used + len > arena_size )
+	{
+		if ( arena )
+			arena_full.push_back( arena );
+
+		arena_size = ( arena_size ? 2 * arena_size : 4096 );
+		while ( arena_size < len )
+			arena_size *= 2;
+		arena = new char[ arena_size ];
+		arena_used = 0;
+	}
+
+	char *ptr = arena + arena_used;
+	arena_used += len;
+
+	return ptr;
+}
+
+// return the unescaped csv field, and set field_length to its length
+// points to the field itself if no quote is escaped, or to a copy in the arena, valid until fetch_line()
+char *csv_reader::unescape_field ( char *field_start, unsigned *field_length )
+{
+	if ( *field_length < 2 || field_start[ 0 ] != quot )
+		return field_start;
+
+	char *ptr = field_start + 1;
+	unsigned len = *field_length - 2;
+
+	char *pquot = (char*)memchr( ptr, quot, len );
+	if ( ! pquot )
+	{
+		*field_length = len;
+		return ptr;
+	}
+
+	// escaped quotes: the unescaped field is shorter
+	char *out = arena_alloc( len );
+	char *cur = out;
+	do
+	{
+		// copy up to the first quote of the escape
+		memcpy( cur, ptr, pquot - ptr + 1 );
+		cur += pquot - ptr + 1;
+		len -= pquot - ptr + 2;
+		ptr = pquot + 2;
+	} while ( (int)len > 0 && ( pquot = (char*)memchr( ptr, quot, len ) ) );
+
+	if ( (int)len > 0 )
+	{
+		memcpy( cur, ptr, len );
+		cur += len;
+	}
+
+	*field_length = cur - out;
+	return out;
+}
+
 // return the escaped version of an unescaped string
 std::string csv_reader::escape_csv_string ( const std::string &str, const char quot )
 {
@@ -714,6 +1933,319 @@ std::vector<std::string>* csv_reader::parse_line ( )
 	return vec;
 }
 
+csv_batch::csv_batch ( const unsigned max_rows ) :
+	max_rows(max_rows ? max_rows : 1),
+	rows(0),
+	max_fields(~0U),
+	row_field(NULL),
+	fields(0),
+	fields_size(0),
+	field_off(NULL),
+	field_len(NULL),
+	data(NULL),
+	data_len(0),
+	data_size(0)
+{
+	row_field = new unsigned[ this->max_rows + 1 ];
+	row_field[ 0 ] = 0;
+}
+
+csv_batch::~csv_batch ( )
+{
+	delete[] row_field;
+	delete[] field_off;
+	delete[] field_len;
+	delete[] data;
+}
+
+void csv_batch::clear ( )
+{
+	rows = 0;
+	fields = 0;
+	data_len = 0;
+}
+
+// ensure room for len more bytes of data and nfields more fields
+void csv_batch::reserve ( unsigned len, unsigned nfields )
+{
+	if ( data_len + len > data_size )
+	{
+		unsigned new_size = ( data_size ? data_size : 64*1024 );
+		while ( new_size < data_len + len )
+			new_size *= 2;
+
+		char *new_data = new char[ new_size ];
+		if ( data )
+			memcpy( new_data, data, data_len );
+		delete[] data;
+
+		data = new_data;
+		data_size = new_size;
+	}
+
+	if ( fields + nfields > fields_size )
+	{
+		unsigned new_size = ( fields_size ? fields_size : 4096 );
+		while ( new_size < fields + nfields )
+			new_size *= 2;
+
+		unsigned *new_off = new unsigned[ new_size ];
+		unsigned *new_len = new unsigned[ new_size ];
+		if ( field_off )
+		{
+			memcpy( new_off, field_off, fields * sizeof(*field_off) );
+			memcpy( new_len, field_len, fields * sizeof(*field_len) );
+		}
+		delete[] field_off;
+		delete[] field_len;
+
+		field_off = new_off;
+		field_len = new_len;
+		fields_size = new_size;
+	}
+}
+
+// append the current row to batch, up to batch->max_fields fields
+template <int SEP, int QUOT>
+void csv_reader::batch_row ( csv_batch *batch )
+{
+	unsigned base = batch->data_len;
+	unsigned max_fields = batch->max_fields;
+	unsigned used = ~0U;	// row data referenced by the fields, the whole row by default
+
+	cur_field_offset = 0;
+	field_idx = 0;
+
+	if ( max_fields == 0 )
+	{
+		skip_fields<SEP, QUOT>();
+		used = 0;
+	}
+	else
+	{
+		if ( field_seps_count == INDEX_NONE || ( index_partial && (unsigned)field_seps_count < max_fields ) )
+			index_line<SEP, QUOT>( max_fields - 1 );
+
+		if ( field_seps_count >= 0 )
+		{
+			// fields from the structural index
+			unsigned nseps = field_seps_count;
+			bool last = ! index_partial;	// the field after the last separator ends the row
+			if ( nseps >= max_fields )
+			{
+				nseps = max_fields;
+				last = false;
+			}
+
+			batch->reserve( cur_line_length, nseps + 1 );
+
+			unsigned start = 0;
+			for ( unsigned i = 0 ; i < nseps ; ++i )
+			{
+				batch->field_off[ batch->fields ] = base + start;
+				batch->field_len[ batch->fields ] = field_seps[ i ] - start;
+				++batch->fields;
+				start = field_seps[ i ] + 1;
+			}
+
+			if ( last )
+			{
+				batch->field_off[ batch->fields ] = base + start;
+				batch->field_len[ batch->fields ] = cur_line_length - start;
+				++batch->fields;
+
+				cur_field_offset = cur_line_length + 1;
+			}
+			else
+			{
+				used = start - 1;
+				field_idx = nseps;
+				cur_field_offset = start;
+				skip_fields<SEP, QUOT>();
+			}
+		}
+		else
+		{
+			char *line = NULL;
+			unsigned off = 0, len = 0;
+			unsigned n = 0;
+
+			while ( n < max_fields && read_field<SEP, QUOT>( &line, &off, &len ) )
+			{
+				batch->reserve( 0, 1 );
+				batch->field_off[ batch->fields ] = base + off;
+				batch->field_len[ batch->fields ] = len;
+				++batch->fields;
+				++n;
+			}
+
+			if ( n == max_fields )
+				skip_fields<SEP, QUOT>();
+		}
+	}
+
+	// copy once all fields are read, cur_line may have moved for a multi-line row
+	if ( used > cur_line_length )
+		used = cur_line_length;
+	batch->reserve( used, 0 );
+	memcpy( batch->data + base, cur_line, used );
+	batch->data_len += used;
+
+	batch->row_field[ ++batch->rows ] = batch->fields;
+}
+
+// skip the fields left in the current row
+// the row may continue on the next lines if a quoted field left spans lines: quotes are scanned up to the row end
+template <int SEP, int QUOT>
+void csv_reader::skip_fields ( )
+{
+	const char quot = QUOT_CHAR;
+
+	if ( failed || cur_field_offset > cur_line_length )
+		return;
+
+	if ( field_seps_count == INDEX_NONE || index_partial )
+	{
+		// not in a quoted field, and no quote left: the row ends with the current line
+		unsigned from = ( index_partial ? index_st.off : 0 );
+		if ( ! ( index_partial && index_st.inside ) && ! memchr( cur_line + from, quot, cur_line_length - from ) )
+		{
+			cur_field_offset = cur_line_length + 1;
+			return;
+		}
+
+		index_line<SEP, QUOT>( ~0U );
+	}
+
+	if ( field_seps_count >= 0 )
+	{
+		cur_field_offset = cur_line_length + 1;
+		field_idx = field_seps_count + 1;
+		return;
+	}
+
+	// byte by byte parser
+	char *line = NULL;
+	unsigned off = 0, len = 0;
+	while ( read_field<SEP, QUOT>( &line, &off, &len ) )
+		;
+}
+
+// skip the fields left in the current row, return the row start in line_start if not NULL (the row may move)
+void csv_reader::skip_row ( char* *line_start )
+{
+	(this->*skip_fields_fn)();
+
+	if ( line_start )
+		*line_start = cur_line;
+}
+
+// parse the current row and the following ones into batch, up to batch->max_rows
+template <int SEP, int QUOT>
+bool csv_reader::read_batch_rows ( csv_batch *batch )
+{
+	batch->clear();
+
+	if ( batch_fetch_pending )
+	{
+		batch_fetch_pending = false;
+		fetch_line();
+	}
+
+	while ( ! failed && batch->rows < batch->max_rows )
+	{
+		batch_row<SEP, QUOT>( batch );
+
+		// do not wait for input with the rows of the batch not output yet
+		if ( ! input_lines->line_buffered() )
+		{
+			batch_fetch_pending = true;
+			break;
+		}
+
+		fetch_line();
+	}
+
+	return batch->rows > 0;
+}
+
+// parse the current row and the following ones into batch, up to batch->max_rows
+// the row after the batch becomes the current row (as after fetch_line())
+// return false if no row was available
+bool csv_reader::read_batch ( csv_batch *batch )
+{
+	return (this->*read_batch_fn)( batch );
+}
+
+// mmapped input: return the file descriptor, the file size and the file offset of the current row
+bool csv_reader::row_position ( int *fd, off_t *offset, off_t *size ) const
+{
+	if ( failed || ! cur_line )
+		return false;
+
+	return input_lines->map_position( cur_line, fd, offset, size );
+}
+
+// call fn( arg ) before the data of the rows returned so far is overwritten or unmapped, fn = NULL to remove
+void csv_reader::set_release_hook ( void (*fn)( void *arg ), void *arg )
+{
+	input_lines->set_release_hook( fn, arg );
+}
+
+// call fn( arg ) when the input has no data ready, before waiting for it, fn = NULL to remove
+void csv_reader::set_idle_hook ( unsigned (*fn)( void *arg ), void *arg )
+{
+	input_lines->set_idle_hook( fn, arg );
+}
+
+// return true if the rows are in a file mapping: their data does not change, even after the release hook,
+// unless the client modifies it
+bool csv_reader::rows_mapped ( ) const
+{
+	return input_lines->lines_mapped();
+}
+
+// return the length of the current row, and the length of its newline (0 to 2) in newline
+unsigned csv_reader::row_length ( unsigned *newline ) const
+{
+	if ( newline )
+		*newline = cur_line_length_nl - cur_line_length;
+
+	return cur_line_length;
+}
+
+// memory area input: return the offset of the row following the current one
+unsigned csv_reader::range_offset ( ) const
+{
+	return input_lines->offset();
+}
+
+// return true if a row was longer than line_max, which stops the parsing
+bool csv_reader::input_error ( ) const
+{
+	return input_lines->had_error();
+}
+
+// hand the rest of the input, from the current position in the current row, over to the caller
+bool csv_reader::take_input ( char* *data, unsigned *len, int *fd, off_t *offset )
+{
+	if ( failed || ! cur_line )
+		return false;
+
+	unsigned off = ( cur_field_offset < cur_line_length_nl ? cur_field_offset : cur_line_length_nl );
+
+	if ( ! input_lines->take_input( cur_line + off, data, len, fd, offset ) )
+		return false;
+
+	// as after the last row
+	failed = true;
+	cur_line = NULL;
+	cur_field_offset = 1;
+	cur_line_length = cur_line_length_nl = 0;
+
+	return true;
+}
+
 // read raw data (dont mix with read_*)
 void csv_reader::read ( char* *ptr, unsigned *len )
 {
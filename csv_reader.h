@@ -1,14 +1,67 @@
 #ifndef CSVREADER_H
 #define CSVREADER_H
 
+#include <sys/types.h>
+#include <vector>
+
+#include "csv_index.h"
+
 class line_reader;
 
+// a batch of csv rows, filled by csv_reader::read_batch()
+// the fields of row r are field_off/field_len[ row_field[ r ] .. row_field[ r + 1 ] - 1 ], offsets are relative to data
+// rows are copied in data, so that all rows of a batch are valid together, until the next read_batch()
+class csv_batch
+{
+public:
+	unsigned max_rows;
+	unsigned rows;
+	unsigned max_fields;	// fields stored per row, the next ones are skipped (default all)
+	unsigned *row_field;	// max_rows + 1 entries
+
+	unsigned fields;
+	unsigned fields_size;
+	unsigned *field_off;
+	unsigned *field_len;
+
+	char *data;
+	unsigned data_len;
+	unsigned data_size;
+
+	explicit csv_batch ( const unsigned max_rows = 256 );
+	~csv_batch ( );
+
+	void clear ( );
+
+	// ensure room for len more bytes of data and nfields more fields
+	void reserve ( unsigned len, unsigned nfields );
+
+	unsigned row_fields ( const unsigned row ) const
+	{
+		return row_field[ row + 1 ] - row_field[ row ];
+	}
+
+	// field f of row r, or NULL if the row has less fields (or f >= max_fields)
+	const char *field ( const unsigned row, const unsigned f, unsigned *len ) const
+	{
+		unsigned idx = row_field[ row ] + f;
+		if ( idx >= row_field[ row + 1 ] )
+			return NULL;
+
+		*len = field_len[ idx ];
+		return data + field_off[ idx ];
+	}
+
+private:
+	csv_batch ( const csv_batch& );
+	csv_batch& operator=( const csv_batch& );
+};
+
 class csv_reader
 {
 private:
 	line_reader *input_lines;
 	unsigned line_max;
-	char *line_copy;
 	bool failed;
 
 	char sep;
@@ -18,10 +71,61 @@ private:
 	unsigned cur_line_length;
 	unsigned cur_line_length_nl;
 	unsigned cur_field_offset;
+	bool cur_line_final;	// the row could not be extended to the next input line
+	bool batch_fetch_pending;	// read_batch() ended before fetching the row after the batch, see read_batch()
+
+	// structural index of cur_line: offsets of the separators outside quoted fields
+	unsigned *field_seps;
+	unsigned field_seps_size;
+	int field_seps_count;	// INDEX_NONE until computed, -1 if the row must be parsed byte by byte (irregular quotes, multi-line field)
+	unsigned field_idx;	// index in field_seps of the end of the next field
+	bool index_partial;	// the index stopped before the end of the row, it resumes from index_st
+	csv_index_state index_st;
+
+	enum {
+		INDEX_NONE = -2,
+	};
+
+	// scratch memory for the unescaped fields of the current row, reset by fetch_line()
+	char *arena;
+	unsigned arena_used;
+	unsigned arena_size;
+	std::vector<char *> arena_full;	// blocks filled during the current row, freed by fetch_line()
+
+	// return room for len bytes in the arena
+	char *arena_alloc ( unsigned len );
 
 	// set cur_line_length from cur_line_length_nl, trim \r\n
 	void trim_newlines ( );
 
+	// append the next input line to the current row, for a quoted field spanning lines
+	// return false if the row cannot be extended (end of input, row longer than line_max)
+	bool extend_row ( );
+
+	// the parsing hot paths are templates specialized for common separator / quote pairs
+	// SEP and QUOT are the constant chars, or -1 to use sep and quot
+	// select_parser() sets the function pointers to the instance matching sep and quot
+	bool (csv_reader::*read_field_fn)( char* *line_start, unsigned *field_offset, unsigned *field_length );
+	bool (csv_reader::*read_batch_fn)( csv_batch *batch );
+	void (csv_reader::*skip_fields_fn)( );
+
+	void select_parser ( );
+
+	// read_csv_field()
+	template <int SEP, int QUOT> bool read_field ( char* *line_start, unsigned *field_offset, unsigned *field_length );
+
+	// compute field_seps for cur_line, until more than want separators are found or up to the row end
+	template <int SEP, int QUOT> void index_line ( unsigned want );
+
+	// append the current row to batch
+	template <int SEP, int QUOT> void batch_row ( csv_batch *batch );
+
+	// skip_row()
+	template <int SEP, int QUOT> void skip_fields ( );
+
+	// read_batch()
+	template <int SEP, int QUOT> bool read_batch_rows ( csv_batch *batch );
+
 public:
 	bool failed_to_open ( ) const;
 
@@ -32,7 +136,14 @@ public:
 	void reset_cur_field_offset ( );
 
 	// line_max is passed to the line_reader, it is also the limit for a full csv row (that may span many lines)
-	explicit csv_reader ( const char *filename, const char sep = ',', const char quot = '"', const unsigned line_max = 64*1024 );
+	// block_size is the size of the input read buffer, independent from line_max (buffers grow up to line_max only when a row needs it)
+	// with threads > 1, reading and decompression of non-mmapped inputs run in a background thread
+	explicit csv_reader ( const char *filename, const char sep = ',', const char quot = '"', const unsigned line_max = 64*1024, const unsigned block_size = 4*1024*1024, const unsigned threads = 1 );
+
+	// parse the rows of a memory area ptr[0..len) instead of a file, fetch_line() stops at rows starting at or after limit
+	// truncated: the input continues after len, so a row reaching len is too long
+	// quiet: errors are not reported, check input_error()
+	csv_reader ( char *ptr, const unsigned len, const unsigned limit, const bool truncated, const char sep, const char quot, const unsigned line_max, const bool quiet );
 	~csv_reader ( );
 
 	// read one line from input_lines
@@ -41,9 +152,9 @@ public:
 	bool fetch_line ( );
 
 	// read one csv field from the current line
-	// returns false if no more fields are available in the line, or if there is a syntax error (unterminated quote, end quote followed by neither a quote nor a separator)
+	// returns false if no more fields are available in the line, or if there is a syntax error (unterminated quote, end quote followed by neither a quote nor a separator), the rest of the row is then ignored
 	// returns a pointer to the line start, the offset of the current field, and its length
-	// the 'field_offset' returned by previous calls for the same line is still valid relative to the new 'line_start' (which may change if one field crosses a line boundary, in that case the lines are copied into an internal buffer)
+	// the 'field_offset' returned by previous calls for the same line is still valid relative to the new 'line_start' (which may change if one field crosses a line boundary, in that case the row is extended in place in the input buffer, which may move)
 	bool read_csv_field ( char* *line_start, unsigned *field_offset, unsigned *field_length );
 
 	// same as read_csv_field ( line_start, field_offset, field_length ) with simpler args
@@ -58,6 +169,11 @@ public:
 	// on return, if unescaped is not NULL, field_start and field_length are undefined.
 	std::string* unescape_csv_field ( char* *field_start, unsigned *field_length, std::string* unescaped = NULL ) const;
 
+	// return the unescaped csv field, and set field_length to its length
+	// points to the field itself if no quote is escaped, or to a copy in memory owned by the reader
+	// valid until fetch_line(), no heap allocation once the reader has seen a few rows
+	char *unescape_field ( char *field_start, unsigned *field_length );
+
 	static std::string escape_csv_string ( const std::string &str, const char quot = '"' );
 
 	// return the escaped version of an unescaped string
@@ -67,9 +183,55 @@ public:
 	// return a pointer to a vector of unescaped strings, should be delete by caller
 	std::vector<std::string>* parse_line ( );
 
+	// parse the current row and the following ones into batch, up to batch->max_rows
+	// the row after the batch becomes the current row (as after fetch_line()), except when the input has no data
+	// ready for it (see set_idle_hook()): the batch then ends and that row is fetched by the next read_batch(), so
+	// that the caller outputs the rows of the batch before the reader waits ; only read_batch() may be called until
+	// it returns false
+	// return false if no row was available
+	bool read_batch ( csv_batch *batch );
+
+	// mmapped input: return the file descriptor, the file size and the file offset of the current row
+	// return false for other inputs
+	bool row_position ( int *fd, off_t *offset, off_t *size ) const;
+
+	// call fn( arg ) before the data of the rows returned so far is overwritten or unmapped, fn = NULL to remove
+	// lets a client keep references to rows (see output_buffer::append_ref())
+	void set_release_hook ( void (*fn)( void *arg ), void *arg );
+
+	// call fn( arg ) when the input has no data ready (a stalled pipe), before waiting for it, fn = NULL to remove
+	// fn returns the time in ms to wait for input before calling it again, ~0U to wait until input arrives
+	// lets a client bound its output latency (see output_buffer::latency_left())
+	void set_idle_hook ( unsigned (*fn)( void *arg ), void *arg );
+
+	// return true if the rows are in a file mapping: their data does not change, even after the release hook,
+	// unless the client modifies it
+	bool rows_mapped ( ) const;
+
+	// return the length of the current row, and the length of its newline (0 to 2) in newline if not NULL
+	unsigned row_length ( unsigned *newline = NULL ) const;
+
+	// memory area input: return the offset of the row following the current one (or where fetch_line() stopped)
+	unsigned range_offset ( ) const;
+
+	// return true if a row was longer than line_max, which stops the parsing
+	bool input_error ( ) const;
+
+	// skip the fields left in the current row, when a client does not need them
+	// this is faster than reading them, but still finds the end of a row holding a multi-line field
+	// returns the row start in line_start if not NULL, as it may move (the field offsets remain valid)
+	void skip_row ( char* *line_start = NULL );
+
 	// read raw data (dont mix with read_*)
 	void read ( char* *ptr, unsigned *len );
 
+	// hand the rest of the input, from the current position in the current row, over to the caller, to copy it
+	// without the reader: data[0..len) is the buffered part, it is followed by the data of fd from offset (-1: from
+	// its current position, eg a pipe) to its end
+	// the reader is then at end of input
+	// return false if the input must go through the reader (compressed, utf16, read-ahead thread), or at end of input
+	bool take_input ( char* *data, unsigned *len, int *fd, off_t *offset );
+
 private:
 	csv_reader ( const csv_reader& );
 	csv_reader& operator=( const csv_reader& );
@@ -10,6 +10,8 @@
 
 #include "output_buffer.h"
 #include "csv_reader.h"
+#include "csv_parallel.h"
+#include "csv_number.h"
 
 
 #define CSV_TOOL_VERSION "20140829"
@@ -29,6 +31,8 @@ private:
 	char sep_out;
 	char quot;
 	unsigned line_max;
+	unsigned block_size;
+	unsigned threads;
 public:
 	unsigned csv_flags;
 private:
@@ -42,6 +46,7 @@ private:
 	std::vector<int> indexes;
 	std::vector< std::vector<unsigned> > inv_indexes;
 	unsigned max_index;
+	unsigned used_fields;	// input fields up to the last one in inv_indexes, the next ones can be skipped
 	std::string out_colspec;
 
 
@@ -89,37 +94,26 @@ private:
 	// handle 0x prefix
 	int str_ull( const std::string &str, unsigned long long *ret ) const
 	{
-		*ret = 0;
+		return str_ull( str.data(), str.size(), ret );
+	}
 
-		if ( str.size() > 2 && str[0] == '0' && str[1] == 'x' )
+	int str_ull( const char *str, const unsigned len, unsigned long long *ret ) const
+	{
+		uint64_t v = 0;
+
+		if ( len > 2 && str[0] == '0' && str[1] == 'x' )
 		{
-			for ( unsigned i = 2 ; i < str.size() ; ++i )
-			{
-				if ( (*ret >> 60) > 0 )
-					return 0;
-				else if ( str[i] >= '0' && str[i] <= '9' )
-					*ret = *ret * 16 + (str[i] - '0');
-				else if ( str[i] >= 'A' && str[i] <= 'F' )
-					*ret = *ret * 16 + (str[i] - 'A' + 10);
-				else if ( str[i] >= 'a' && str[i] <= 'f' )
-					*ret = *ret * 16 + (str[i] - 'a' + 10);
-				else
-					return 0;
-			}
+			if ( ! csv_parse_hex( str + 2, len - 2, &v ) )
+				return 0;
 		}
 		else
 		{
-			for ( unsigned i = 0 ; i < str.size() ; ++i )
-			{
-				if ( (*ret >> 60) > 0 )
-					return 0;
-				else if ( str[i] >= '0' && str[i] <= '9' )
-					*ret = *ret * 10 + (str[i] - '0');
-				else
-					return 0;
-			}
+			// decimal values are limited to 2^60 * 10
+			if ( ! csv_parse_dec( str, len, &v ) || ( v / 10 ) >> 60 )
+				return 0;
 		}
 
+		*ret = v;
 		return 1;
 	}
 
@@ -283,6 +277,10 @@ private:
 
 			inv_indexes[ idx_in ].push_back( idx_out );
 		}
+
+		used_fields = inv_indexes.size();
+		while ( used_fields > 0 && inv_indexes[ used_fields - 1 ].empty() )
+			--used_fields;
 	}
 
 	// create a csv reader, populate indexes from colspec
@@ -291,7 +289,7 @@ private:
 	{
 		cleanup();
 
-		reader = new csv_reader( filename, sep, quot, line_max );
+		reader = new csv_reader( filename, sep, quot, line_max, block_size, threads );
 
 		if ( reader->failed_to_open() )
 		{
@@ -299,6 +297,9 @@ private:
 			return false;
 		}
 
+		// flush the output when the input stalls, see output_buffer::set_max_latency()
+		reader->set_idle_hook( latency_hook, outbuf );
+
 		if ( ! HAS_FLAG( NO_HEADERLINE ) )
 		{
 			if ( ! reader->fetch_line() )
@@ -318,6 +319,66 @@ private:
 		return true;
 	}
 
+	// process rows from the current row of a reader, write to out
+	// ctx holds the mode state, worker is 0..threads (included) for per-thread state
+	typedef void (csv_tool::*rows_fn)( void *ctx, unsigned worker, csv_reader *rd, output_buffer *out );
+
+	struct rows_job {
+		csv_tool *tool;
+		rows_fn fn;
+		void *ctx;
+	};
+
+	static void run_rows_job ( void *arg, unsigned worker, csv_reader *rd, output_buffer *out )
+	{
+		rows_job *job = (rows_job *)arg;
+		(job->tool->*job->fn)( job->ctx, worker, rd, out );
+	}
+
+	// process the rows of reader, from its current row, with fn
+	// with threads > 1 and a mmapped input file, the file is split in chunks processed in parallel (see csv_parallel)
+	// otherwise fn runs on reader and outbuf, with worker = threads
+	void process_rows ( rows_fn fn, void *ctx )
+	{
+		if ( threads > 1 )
+		{
+			rows_job job = { this, fn, ctx };
+			csv_parallel par( reader, sep, quot, line_max, block_size, threads );
+
+			if ( par.run( run_rows_job, &job, outbuf ) )
+				return;
+		}
+
+		(this->*fn)( ctx, threads, reader, outbuf );
+	}
+
+	static void release_refs_hook ( void *out )
+	{
+		((output_buffer *)out)->release_refs();
+	}
+
+	static unsigned latency_hook ( void *out )
+	{
+		return ((output_buffer *)out)->latency_left();
+	}
+
+	// output the first len bytes of the current row of rd, and a newline
+	// the data is passed by reference to the input buffer, see output_buffer::append_ref()
+	void output_row ( csv_reader *rd, output_buffer *out, const char *line, unsigned len )
+	{
+		const bool stable = rd->rows_mapped();
+		unsigned nl;
+
+		// the row ends with the newline we output: one slice, merged with the next row if it is output too
+		if ( len == rd->row_length( &nl ) && nl == 2 )
+			out->append_ref( line, len + 2, stable );
+		else
+		{
+			out->append_ref( line, len, stable );
+			out->append_nl();
+		}
+	}
+
 	// split a string "k1=v1,k2=v2,k3=v3" into vectors [k1, k2, k3] and [v1, v2, v3]
 	// k may be omitted with -H
 	bool split_colvalspec( const std::string &colval, std::vector<std::string> *cols, std::vector<std::string> *vals )
@@ -359,7 +420,7 @@ private:
 
 	std::string ull_str ( const unsigned long long nr, const char *fmt = "%llu" )
 	{
-		char buf[16];
+		char buf[32];
 		unsigned buf_sz = snprintf( buf, sizeof(buf), fmt, nr );
 		if ( buf_sz > sizeof(buf) )
 			buf_sz = sizeof(buf);
@@ -379,16 +440,19 @@ private:
 	}
 
 public:
-	explicit csv_tool ( output_buffer *outbuf, char sep = ',', char sep_out = ',', char quot = '"', unsigned line_max = 64*1024, unsigned csv_flags = 0 ) :
+	explicit csv_tool ( output_buffer *outbuf, char sep = ',', char sep_out = ',', char quot = '"', unsigned line_max = 64*1024, unsigned block_size = 4*1024*1024, unsigned threads = 1, unsigned csv_flags = 0 ) :
 		sep(sep),
 		sep_out(sep_out),
 		quot(quot),
 		line_max(line_max),
+		block_size(block_size),
+		threads(threads),
 		csv_flags(csv_flags),
 		outbuf(outbuf),
 		reader(NULL),
 		headers(NULL),
-		max_index(0)
+		max_index(0),
+		used_fields(0)
 	{
 		indexes.clear();
 		inv_indexes.clear();
@@ -420,35 +484,39 @@ public:
 		if ( HAS_FLAG( EXTRACT_ZERO ) )
 			zero = 1;	// lol!
 
+		process_rows( &csv_tool::extract_rows, &zero );
+	}
+
+	// process_rows() callback of extract()
+	void extract_rows ( void *ctx, unsigned, csv_reader *rd, output_buffer *out )
+	{
+		int zero = *(int *)ctx;
+
 		do
 		{
 			char *ptr = NULL;
 			unsigned len = 0;
 			unsigned idx_in = 0;
 
-			while ( reader->read_csv_field( &ptr, &len ) )
+			while ( idx_in < used_fields && rd->read_csv_field( &ptr, &len ) )
 			{
-				if ( ( idx_in < inv_indexes.size() ) && ( inv_indexes[ idx_in ].size() > 0 ) )
+				if ( inv_indexes[ idx_in ].size() > 0 )
 				{
-					std::string *str = reader->unescape_csv_field( &ptr, &len );
-					if ( str )
-					{
-						outbuf->append( str );
-						delete str;
-					}
-					else
-						outbuf->append( ptr, len );
+					ptr = rd->unescape_field( ptr, &len );
+					out->append( ptr, len );
 				}
 
-				// cannot break: a later field may include a newline
 				++idx_in;
 			}
+			// a later field may include a newline
+			rd->skip_row();
+
 			if ( zero )
-				outbuf->append( '\0' );
+				out->append( '\0' );
 			else
-				outbuf->append_nl();
+				out->append_nl();
 
-		} while ( reader->fetch_line() );
+		} while ( rd->fetch_line() );
 	}
 
 
@@ -469,7 +537,7 @@ public:
 				int idx_in = indexes[ i ];
 
 				if ( idx_in != -1 )
-					outbuf->append( reader->escape_csv_field( (*headers)[ idx_in ] ) );
+					outbuf->append_escaped( (*headers)[ idx_in ], quot );
 			}
 			outbuf->append_nl();
 		}
@@ -477,60 +545,44 @@ public:
 		if ( reader->eos() )
 			return out_colspec;
 
+		process_rows( &csv_tool::select_rows, NULL );
+
+		return out_colspec;
+	}
+
+	// process_rows() callback of select()
+	void select_rows ( void *, unsigned, csv_reader *rd, output_buffer *out )
+	{
 		unsigned idx_len = indexes.size();
-		unsigned *fld_off = new unsigned[ idx_len ];
-		unsigned *fld_len = new unsigned[ idx_len ];
 		const bool may_need_escape = ( sep_out != sep );
+		csv_batch batch;
+		batch.max_fields = used_fields;
 
-		do
+		while ( rd->read_batch( &batch ) )
 		{
-			for ( unsigned idx_out = 0 ; idx_out < idx_len ; ++idx_out )
-				fld_off[ idx_out ] = (unsigned)-1;
-
-			// parse input row
-			char *line = NULL;
-			unsigned f_off = 0, f_len = 0;
-			unsigned idx_in = 0;
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
+			for ( unsigned row = 0 ; row < batch.rows ; ++row )
 			{
-				if ( idx_in < inv_indexes.size() && inv_indexes[ idx_in ].size() )
+				// generate output row
+				for ( unsigned idx_out = 0 ; idx_out < idx_len ; ++idx_out )
 				{
-					// current input field appears in output, save its off+len
-					for ( unsigned i = 0 ; i < inv_indexes[ idx_in ].size() ; ++i )
-					{
-						unsigned idx_out = inv_indexes[ idx_in ][ i ];
-						fld_off[ idx_out ] = f_off;
-						fld_len[ idx_out ] = f_len;
-					}
-				}
-				++idx_in;
-			}
+					if ( idx_out > 0 )
+						out->append( sep_out );
 
-			// generate output row
-			for ( unsigned idx_out = 0 ; idx_out < idx_len ; ++idx_out )
-			{
-				if ( idx_out > 0 )
-					outbuf->append( sep_out );
+					int idx_in = indexes[ idx_out ];
+					const char *fld = NULL;
+					unsigned fld_len = 0;
 
-				if ( fld_off[ idx_out ] != (unsigned)-1 )
-				{
-					if ( may_need_escape && fld_len[ idx_out ] && ( line[ fld_off[ idx_out ] ] != quot ) )
-					{
-						std::string raw_f( line + fld_off[ idx_out ], fld_len[ idx_out ] );
-						outbuf->append( reader->escape_csv_field( raw_f ) );
-					} else
-						outbuf->append( line + fld_off[ idx_out ], fld_len[ idx_out ] );
+					if ( idx_in == -1 || ! ( fld = batch.field( row, idx_in, &fld_len ) ) )
+						continue;
+
+					if ( may_need_escape && fld_len && ( fld[ 0 ] != quot ) )
+						out->append_escaped( fld, fld_len, quot );
+					else
+						out->append( fld, fld_len );
 				}
+				out->append_nl();
 			}
-			outbuf->append_nl();
-
-		} while ( reader->fetch_line() );
-
-
-		delete[] fld_off;
-		delete[] fld_len;
-
-		return out_colspec;
+		}
 	}
 
 
@@ -552,7 +604,7 @@ public:
 				if ( colnum_out++ > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[ i ] ) );
+				outbuf->append_escaped( (*headers)[ i ], quot );
 
 				++colnum_out;
 			}
@@ -562,6 +614,12 @@ public:
 		if ( reader->eos() )
 			return;
 
+		process_rows( &csv_tool::deselect_rows, NULL );
+	}
+
+	// process_rows() callback of deselect()
+	void deselect_rows ( void *, unsigned, csv_reader *rd, output_buffer *out )
+	{
 		do
 		{
 			char *fld = NULL;
@@ -569,20 +627,20 @@ public:
 			unsigned colnum = 0;
 			unsigned colnum_out = 0;
 
-			while ( reader->read_csv_field( &fld, &fld_len ) )
+			while ( rd->read_csv_field( &fld, &fld_len ) )
 			{
 				if ( inv_indexes[ colnum++ ].size() )
 					continue;
 
 				if ( colnum_out++ > 0 )
-					outbuf->append( sep_out );
+					out->append( sep_out );
 
-				outbuf->append( fld, fld_len );
+				out->append( fld, fld_len );
 			}
 
-			outbuf->append_nl();
+			out->append_nl();
 
-		} while ( reader->fetch_line() );
+		} while ( rd->fetch_line() );
 	}
 
 
@@ -604,7 +662,7 @@ public:
 		{
 			for ( unsigned i = 0 ; i < max_index ; ++i )
 			{
-				outbuf->append( ull_str( i ) );
+				outbuf->append_uint( i );
 				outbuf->append_nl();
 			}
 		}
@@ -626,13 +684,13 @@ public:
 		{
 			for ( unsigned i = 0 ; i < cols.size() ; ++i )
 			{
-				outbuf->append( reader->escape_csv_field( cols[i] ) );
+				outbuf->append_escaped( cols[i], quot );
 				outbuf->append( sep_out );
 			}
 
 			for ( unsigned i = 0 ; i < headers->size() ; ++i )
 			{
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_escaped( (*headers)[i], quot );
 
 				if ( i + 1 < headers->size() )
 					outbuf->append( sep_out );
@@ -686,65 +744,72 @@ public:
 			colspec.append( cols[ i ] );
 		}
 
-		regex_t *vals_re = new regex_t[ vals.size() ];
+		// regexec() locks its regex_t: one copy per worker
+		grep_ctx ctx;
+		ctx.nvals = vals.size();
+		ctx.invert = HAS_FLAG( RE_INVERT );
+		ctx.vals_re = new regex_t[ ctx.nvals * ( threads + 1 ) ];
 
 		int flags = REG_NOSUB | REG_EXTENDED;
 		if ( HAS_FLAG( RE_NOCASE ) )
 			flags |= REG_ICASE;
 
-		for ( unsigned i = 0 ; i < vals.size() ; ++i )
+		for ( unsigned i = 0 ; i < ctx.nvals * ( threads + 1 ) ; ++i )
 		{
-
-			int err = regcomp( &vals_re[ i ], vals[ i ].c_str(), flags );
+			int err = regcomp( &ctx.vals_re[ i ], vals[ i % ctx.nvals ].c_str(), flags );
 			if ( err )
 			{
 				char errbuf[1024];
-				regerror( err, &vals_re[ i ], errbuf, sizeof(errbuf) );
-				std::cerr << "Invalid regexp /" << vals[ i ] << "/ : " << errbuf << std::endl;
+				regerror( err, &ctx.vals_re[ i ], errbuf, sizeof(errbuf) );
+				std::cerr << "Invalid regexp /" << vals[ i % ctx.nvals ] << "/ : " << errbuf << std::endl;
 
 				for ( unsigned j = 0 ; j < i ; ++j )
-					regfree( &vals_re[ j ] );
-				delete[] vals_re;
+					regfree( &ctx.vals_re[ j ] );
+				delete[] ctx.vals_re;
 
 				return;
 			}
 		}
 
-		if ( ! start_reader( colspec, filename ) )
+		if ( start_reader( colspec, filename ) )
 		{
-			for ( unsigned i = 0 ; i < vals.size() ; ++i )
-				regfree( &vals_re[ i ] );
-			delete[] vals_re;
-
-			return;
-		}
-
-		if ( headers )
-		{
-			for ( unsigned i = 0 ; i < headers->size() ; ++i )
+			if ( headers )
 			{
-				if ( i > 0 )
-					outbuf->append( sep_out );
+				for ( unsigned i = 0 ; i < headers->size() ; ++i )
+				{
+					if ( i > 0 )
+						outbuf->append( sep_out );
+
+					outbuf->append_escaped( (*headers)[i], quot );
+				}
 
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_nl();
 			}
 
-			outbuf->append_nl();
+			if ( ! reader->eos() )
+				process_rows( &csv_tool::grepcol_rows, &ctx );
 		}
 
-		if ( reader->eos() )
-		{
-			for ( unsigned i = 0 ; i < vals.size() ; ++i )
-				regfree( &vals_re[ i ] );
-			delete[] vals_re;
+		for ( unsigned i = 0 ; i < ctx.nvals * ( threads + 1 ) ; ++i )
+			regfree( &ctx.vals_re[ i ] );
+		delete[] ctx.vals_re;
+	}
 
-			return;
-		}
+	struct grep_ctx {
+		regex_t *vals_re;	// nvals regexes per worker
+		unsigned nvals;
+		bool invert;
+	};
+
+	// process_rows() callback of grepcol()
+	void grepcol_rows ( void *arg, unsigned worker, csv_reader *rd, output_buffer *out )
+	{
+		grep_ctx *ctx = (grep_ctx *)arg;
+		regex_t *vals_re = ctx->vals_re + worker * ctx->nvals;
+
+		// matching rows are output as references to the input
+		rd->set_release_hook( release_refs_hook, out );
 
-		const unsigned stats_batch_size = 16*1024;
-		unsigned stats_seen = 0;
-		unsigned stats_match = (headers ? 1 : 0);
-		bool invert = HAS_FLAG( RE_INVERT );
 		do
 		{
 			char *line = NULL;
@@ -752,48 +817,44 @@ public:
 			unsigned idx_in = 0;
 			bool show = false;
 
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
+			while ( rd->read_csv_field( &line, &f_off, &f_len ) )
 			{
 				if ( ( idx_in < inv_indexes.size() ) && ( inv_indexes[ idx_in ].size() ) )
 				{
-					std::string str;
-					char *ptr = line + f_off;
 					unsigned len = f_len;
-					reader->unescape_csv_field( &ptr, &len, &str );
+					const char *ptr = rd->unescape_field( line + f_off, &len );
 
 					for ( unsigned i = 0 ; i < inv_indexes[ idx_in ].size() ; ++i )
 					{
 						unsigned idx_g = inv_indexes[ idx_in ][ i ];
-						if ( idx_g < vals.size() && regexec( &vals_re[ idx_g ], str.c_str(), 0, NULL, 0 ) != REG_NOMATCH )
+						if ( idx_g >= ctx->nvals )
+							continue;
+
+						// match the field in place, it is not nul-terminated
+						regmatch_t range;
+						range.rm_so = 0;
+						range.rm_eo = len;
+						if ( regexec( &vals_re[ idx_g ], ptr, 1, &range, REG_STARTEND ) != REG_NOMATCH )
 							show = true;
 					}
 				}
 				++idx_in;
-			}
 
-			if ( show ^ invert )
-			{
-				outbuf->append( line, f_off + f_len );
-				outbuf->append_nl();
-				++stats_match;
+				// the row will not be shown, the fields left are not needed
+				if ( idx_in == used_fields && ! ( show ^ ctx->invert ) )
+				{
+					rd->skip_row();
+					break;
+				}
 			}
-			++stats_seen;
 
-			// manually flush if output is sparse
-			if ( stats_seen > stats_batch_size )
-			{
-				if ( ( stats_match > 0 ) && ( stats_match < stats_batch_size / 8 ) )
-					outbuf->flush();
-				stats_seen = 0;
-				// ensure we'll flush next time if we didnt now and next is empty
-				stats_match = ( ( stats_match >= stats_batch_size / 8 ) ? 1 : 0 );
-			}
+			if ( show ^ ctx->invert )
+				output_row( rd, out, line, f_off + f_len );
 
-		} while ( reader->fetch_line() );
+		} while ( rd->fetch_line() );
 
-		for ( unsigned i = 0 ; i < vals.size() ; ++i )
-			regfree( &vals_re[ i ] );
-		delete[] vals_re;
+		out->release_refs();
+		rd->set_release_hook( NULL, NULL );
 	}
 
 
@@ -860,7 +921,7 @@ public:
 				if ( i > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_escaped( (*headers)[i], quot );
 			}
 
 			outbuf->append_nl();
@@ -873,10 +934,33 @@ public:
 			return;
 		}
 
-		const unsigned stats_batch_size = 16*1024;
-		unsigned stats_seen = 0;
-		unsigned stats_match = (headers ? 1 : 0);
-		bool invert = HAS_FLAG( RE_INVERT );
+		fgrep_ctx ctx;
+		ctx.vals_set = vals_set;
+		ctx.nvals = vals.size();
+		ctx.nocase = nocase;
+		ctx.invert = HAS_FLAG( RE_INVERT );
+
+		process_rows( &csv_tool::fgrepcol_rows, &ctx );
+
+		delete[] vals_set;
+	}
+
+	struct fgrep_ctx {
+		std::tr1::unordered_set<std::string> *vals_set;
+		unsigned nvals;
+		bool nocase;
+		bool invert;
+	};
+
+	// process_rows() callback of fgrepcol()
+	void fgrepcol_rows ( void *arg, unsigned, csv_reader *rd, output_buffer *out )
+	{
+		fgrep_ctx *ctx = (fgrep_ctx *)arg;
+		std::string str;	// reused: no allocation once it is large enough
+
+		// matching rows are output as references to the input
+		rd->set_release_hook( release_refs_hook, out );
+
 		do
 		{
 			char *line = NULL;
@@ -884,57 +968,42 @@ public:
 			unsigned idx_in = 0;
 			bool show = false;
 
-			while ( reader->read_csv_field( &line, &f_off, &f_len ) )
+			while ( rd->read_csv_field( &line, &f_off, &f_len ) )
 			{
 				if ( ( idx_in < inv_indexes.size() ) && inv_indexes[ idx_in ].size() )
 				{
-					std::string str;
-					char *ptr = line + f_off;
 					unsigned len = f_len;
-					reader->unescape_csv_field( &ptr, &len, &str );
+					const char *ptr = rd->unescape_field( line + f_off, &len );
+
+					str.assign( ptr, len );
+					if ( ctx->nocase )
+						for ( unsigned i = 0 ; i < len ; ++i )
+							str[ i ] = tolower( str[ i ] );
 
 					for ( unsigned i = 0 ; i < inv_indexes[ idx_in ].size() ; ++i )
 					{
 						unsigned idx_g = inv_indexes[ idx_in ][ i ];
-						if ( idx_g >= vals.size() )
-							continue;
-
-						if ( nocase )
-						{
-							if ( vals_set[ idx_g ].count( str_downcase( str ) ) > 0 )
-								show = true;
-						}
-						else
-						{
-							if ( vals_set[ idx_g ].count( str ) > 0 )
-								show = true;
-						}
+						if ( idx_g < ctx->nvals && ctx->vals_set[ idx_g ].count( str ) > 0 )
+							show = true;
 					}
 				}
 				++idx_in;
-			}
 
-			if ( show ^ invert )
-			{
-				outbuf->append( line, f_off + f_len );
-				outbuf->append_nl();
-				++stats_match;
+				// the row will not be shown, the fields left are not needed
+				if ( idx_in == used_fields && ! ( show ^ ctx->invert ) )
+				{
+					rd->skip_row();
+					break;
+				}
 			}
-			++stats_seen;
 
-			// manually flush if output is sparse
-			if ( stats_seen > stats_batch_size )
-			{
-				if ( ( stats_match > 0 ) && ( stats_match < stats_batch_size / 8 ) )
-					outbuf->flush();
-				stats_seen = 0;
-				// ensure we'll flush next time if we didnt now and next is empty
-				stats_match = ( ( stats_match >= stats_batch_size / 8 ) ? 1 : 0 );
-			}
+			if ( show ^ ctx->invert )
+				output_row( rd, out, line, f_off + f_len );
 
-		} while ( reader->fetch_line() );
+		} while ( rd->fetch_line() );
 
-		delete[] vals_set;
+		out->release_refs();
+		rd->set_release_hook( NULL, NULL );
 	}
 
 
@@ -951,11 +1020,11 @@ public:
 				if ( i > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_escaped( (*headers)[i], quot );
 			}
 
 			outbuf->append( sep_out );
-			outbuf->append( reader->escape_csv_field( "concat" ) );
+			outbuf->append_escaped( std::string( "concat" ), quot );
 
 			outbuf->append_nl();
 		}
@@ -976,10 +1045,9 @@ public:
 			{
 				if ( ( idx_in < inv_indexes.size() ) && ( inv_indexes[ idx_in ].size() ) )
 				{
-					flds[ idx_in ].clear();
-					char *ptr = line + f_off;
 					unsigned len = f_len;
-					reader->unescape_csv_field( &ptr, &len, &flds[ idx_in ] );
+					const char *ptr = reader->unescape_field( line + f_off, &len );
+					flds[ idx_in ].assign( ptr, len );
 				}
 				++idx_in;
 			}
@@ -991,7 +1059,7 @@ public:
 			for ( unsigned i = 0 ; i < indexes.size() ; ++i )
 				if ( indexes[ i ] != -1 )
 					ccat += flds[ indexes[ i ] ];
-			outbuf->append( reader->escape_csv_field( ccat ) );
+			outbuf->append_escaped( ccat, quot );
 
 			outbuf->append_nl();
 		} while ( reader->fetch_line() );
@@ -1041,6 +1109,165 @@ public:
 	}
 
 
+	// copy the rest of the input, from the current row, unchanged to the output
+	// the data is moved by the kernel when possible, see output_buffer::append_fd()
+	void copy_rest ( )
+	{
+		char *data;
+		unsigned len;
+		int fd;
+		off_t offset;
+
+		if ( reader->take_input( &data, &len, &fd, &offset ) )
+		{
+			outbuf->append( data, len );
+			outbuf->append_fd( fd, offset );
+			return;
+		}
+
+		while ( ! reader->eos() )
+		{
+			char *ptr = NULL;
+			len = 64*1024;
+
+			reader->read( &ptr, &len );
+			outbuf->append( ptr, len );
+		}
+	}
+
+	// state of scan_rows() between two blocks of input
+	enum {
+		SCAN_FIELD,	// at the start of a field
+		SCAN_UNQUOTED,	// in an unquoted field
+		SCAN_QUOTED,	// in a quoted field
+		SCAN_QUOTE,	// after a quote in a quoted field: an escaped quote, or the end of the field
+		SCAN_CR,	// after a \r out of a quoted field
+	};
+
+	// scan data[0..n) from *state as rows() parses it, set *row_end to the offset after its last row end (0: none)
+	// rows() writes the fields back as they are, quotes included, joined by sep_out and ended by a crlf, so it
+	// outputs rows unchanged when they end with a crlf and their quoted fields end before a separator or the row end
+	// (a quoted field followed by other chars is a syntax error, the rest of its row is dropped)
+	// return false at the first byte that does not follow these rules
+	bool scan_rows ( const char *data, size_t n, int *state, size_t *row_end ) const
+	{
+		int st = *state;
+
+		*row_end = 0;
+
+		for ( size_t i = 0 ; i < n ; ++i )
+		{
+			char c = data[ i ];
+
+			switch ( st )
+			{
+			case SCAN_FIELD:
+				if ( c == quot )
+				{
+					st = SCAN_QUOTED;
+					break;
+				}
+				st = SCAN_UNQUOTED;
+				// fall through
+			case SCAN_UNQUOTED:
+				if ( c == sep )
+					st = SCAN_FIELD;
+				else if ( c == '\r' )
+					st = SCAN_CR;
+				else if ( c == '\n' )
+					return false;
+				break;
+			case SCAN_QUOTED:
+				if ( c == quot )
+					st = SCAN_QUOTE;
+				break;
+			case SCAN_QUOTE:
+				if ( c == quot )
+					st = SCAN_QUOTED;
+				else if ( c == sep )
+					st = SCAN_FIELD;
+				else if ( c == '\r' )
+					st = SCAN_CR;
+				else
+					return false;
+				break;
+			case SCAN_CR:
+				if ( c != '\n' )
+					return false;
+				st = SCAN_FIELD;
+				*row_end = i + 1;
+				break;
+			}
+		}
+
+		*state = st;
+
+		return true;
+	}
+
+	// copy the rows left as they are, up to the first one that rows() would change (mmapped files only)
+	// the input is checked by blocks, and each block copied once checked, while it is in the page cache
+	// return true if all the rows were copied, false if the rows must be parsed from the current one
+	bool copy_rows ( )
+	{
+		enum {
+			SCAN_SIZE = 1024*1024,
+		};
+
+		int fd;
+		off_t offset;
+		off_t size;
+
+		if ( sep_out != sep || ! reader->row_position( &fd, &offset, &size ) || offset >= size )
+			return false;
+
+		char *scan = new char[ SCAN_SIZE ];
+		int state = SCAN_FIELD;
+		off_t copied = offset;	// the input before copied is output
+		bool ok = true;
+
+		while ( ok && offset < size )
+		{
+			ssize_t n = pread( fd, scan, ( size - offset > SCAN_SIZE ? (off_t)SCAN_SIZE : size - offset ), offset );
+			if ( n <= 0 )
+				break;
+
+			size_t row_end;
+			ok = scan_rows( scan, n, &state, &row_end );
+
+			if ( row_end )
+			{
+				outbuf->append_fd( fd, copied, offset + row_end - copied );
+				copied = offset + row_end;
+			}
+
+			offset += n;
+		}
+
+		delete[] scan;
+
+		// unterminated last row, rows() ends it with a crlf
+		if ( ok && offset == size && copied < size && state != SCAN_QUOTED )
+		{
+			outbuf->append_fd( fd, copied, size - copied );
+			outbuf->append( ( state == SCAN_CR ? "\n" : "\r\n" ), ( state == SCAN_CR ? 1 : 2 ) );
+			copied = size;
+		}
+
+		if ( copied == size )
+			return true;
+
+		// the rows from the first one not copied are parsed
+		while ( reader->row_position( &fd, &offset, &size ) && offset < copied )
+		{
+			reader->skip_row();
+			if ( ! reader->fetch_line() )
+				return true;
+		}
+
+		return false;
+	}
+
 	// dump a range of csv rows
 	// range is [row_start]-[row_end] (included, first row = 0)
 	void rows ( const std::string &rowspec, const char *filename )
@@ -1055,7 +1282,7 @@ public:
 		{
 			for ( unsigned i = 0 ; i < headers->size() ; ++i )
 			{
-				outbuf->append( reader->escape_csv_field( (*headers)[i] ) );
+				outbuf->append_escaped( (*headers)[i], quot );
 
 				if ( i + 1 < headers->size() )
 					outbuf->append( sep_out );
@@ -1095,6 +1322,10 @@ public:
 
 		do
 		{
+			// all the rows left are output: copy them as they are when possible
+			if ( lineno == lineno_min && lineno_max == (unsigned long)-1 && copy_rows() )
+				break;
+
 			char *fld = NULL;
 			unsigned fld_len = 0;
 			unsigned colnum = 0;
@@ -1154,7 +1385,7 @@ public:
 				if ( j < vals.size() )
 					outbuf->append( vals[ j ] );
 				else
-					outbuf->append( ull_str( j ) );
+					outbuf->append_uint( j );
 			}
 			else if ( headers && (unsigned)i < headers->size() )
 			{
@@ -1164,26 +1395,20 @@ public:
 			else
 			{
 				// create new header, use the column number
-				outbuf->append( ull_str( i ) );
+				outbuf->append_uint( i );
 			}
 		}
 		outbuf->append_nl();
 
 		// copy end of file unchanged
-		while ( ! reader->eos() )
-		{
-			char *ptr = NULL;
-			unsigned len = 64*1024;
-
-			reader->read( &ptr, &len );
-			outbuf->append( ptr, len );
-		}
+		copy_rest();
 	}
 
 
-	// output a csv with a column values converted from hex (0x42) to decimal (66)
-	// 64-bit range
-	void decimal ( const std::string &colspec, const char *filename )
+	// output a csv with the values of columns converted from hex (0x42) to decimal (66), or from decimal to hex
+	// with to_hex
+	// 64-bit range, plus the sign
+	void decimal ( const std::string &colspec, const char *filename, bool to_hex = false )
 	{
 		if ( ! start_reader( colspec, filename ) )
 			return;
@@ -1195,7 +1420,7 @@ public:
 				if ( i > 0 )
 					outbuf->append( sep_out );
 
-				outbuf->append( reader->escape_csv_field( (*headers)[ i ] ) );
+				outbuf->append_escaped( (*headers)[ i ], quot );
 			}
 			outbuf->append_nl();
 		}
@@ -1203,51 +1428,91 @@ public:
 		if ( reader->eos() )
 			return;
 
+		process_rows( &csv_tool::decimal_rows, &to_hex );
+	}
+
+	// output the converted unescaped value of a field, return false if it is not a number
+	// to decimal: 0x prefixed hex or decimal, an empty value is 0 ; to hex: decimal
+	bool convert_number ( const char *value, unsigned value_len, const bool to_hex, output_buffer *out ) const
+	{
+		bool minus = false;
+		unsigned long long v;
+
+		if ( value_len > 0 && value[ 0 ] == '-' )
+		{
+			minus = true;
+			++value;
+			--value_len;
+		}
+
+		if ( to_hex )
+		{
+			uint64_t dec;
+			if ( value_len == 0 || ! csv_parse_dec( value, value_len, &dec ) )
+				return false;
+			v = dec;
+		}
+		else if ( ! str_ull( value, value_len, &v ) )
+			return false;
+
+		if ( minus )
+			out->append( '-' );
+
+		if ( to_hex )
+		{
+			out->append( "0x", 2 );
+			out->append_hex( v );
+		}
+		else
+			out->append_uint( v );
+
+		return true;
+	}
+
+	// process_rows() callback of decimal(), ctx points to to_hex
+	// the fields around the converted ones are output as they are, by spans of fields with their separators
+	void decimal_rows ( void *ctx, unsigned, csv_reader *rd, output_buffer *out )
+	{
+		const bool to_hex = *(bool *)ctx;
+		const bool raw_seps = ( sep_out == sep );
+
 		do
 		{
-			char *fld = NULL;
-			unsigned fld_len = 0;
+			char *line = NULL;
+			unsigned off = 0;
+			unsigned len = 0;
 			unsigned colnum = 0;
+			unsigned span = 0;	// start of the fields not output yet
+			unsigned end = 0;	// end of the last field
 
-			while ( reader->read_csv_field( &fld, &fld_len ) )
+			while ( rd->read_csv_field( &line, &off, &len ) )
 			{
-				if ( colnum > 0 )
-					outbuf->append( sep_out );
+				const bool convert = ( colnum < used_fields && ! inv_indexes[ colnum ].empty() );
 
-				if ( inv_indexes[ colnum ].size() )
+				if ( convert || ! raw_seps )
 				{
-					char *fld_dup = fld;
-					unsigned fld_len_dup = fld_len;
-					std::string hex;
-					reader->unescape_csv_field( &fld_dup, &fld_len_dup, &hex );
+					if ( raw_seps )
+						out->append( line + span, off - span );
+					else if ( colnum > 0 )
+						out->append( sep_out );
 
-					unsigned long long v;
-					int minus = 0;
+					unsigned value_len = len;
+					const char *value = ( convert ? rd->unescape_field( line + off, &value_len ) : NULL );
 
-					if ( hex.size() > 0 && hex[0] == '-' )
-					{
-						minus = 1;
-						hex = hex.substr( 1 );
-					}
+					if ( ! convert || ! convert_number( value, value_len, to_hex, out ) )
+						out->append( line + off, len );
 
-					if ( ! str_ull( hex, &v ) )
-						outbuf->append( fld, fld_len );
-					else
-					{
-						if ( minus )
-							outbuf->append( '-' );
-						outbuf->append( ull_str( v ) );
-					}
+					span = off + len;
 				}
-				else
-					outbuf->append( fld, fld_len );
 
+				end = off + len;
 				++colnum;
 			}
 
-			outbuf->append_nl();
+			out->append( line + span, end - span );
+			out->append_nl();
 
-		} while ( reader->fetch_line() );
+		} while ( rd->fetch_line() );
 	}
 };
 
@@ -1257,10 +1522,17 @@ static const char *usage =
 "          -V                 display version information and exit\n"
 "          -h                 display help (this text) and exit\n"
 "          -o <outfile>       specify output file (default=stdout)\n"
+"          -z                 compress the output with gzip (bgzf, compressed by -j threads), default if outfile ends with .gz\n"
 "          -s <separator>     csv field separator (default=',')\n"
 "          -S <separator>     output csv field separator (default=sep) - do not use -s after this option ; ignored in rename\n"
 "          -q <quote>         csv quote character (default='\"')\n"
 "          -L <max line len>  specify maximum line length allowed (default=64k)\n"
+"          -B <block size>    specify input read buffer size (default=4M)\n"
+"          -j <threads>       number of threads (default=1), >1 reads and decompresses input in a background thread,\n"
+"                             splits regular files in chunks of -B bytes (at least -L and 64k) processed in parallel (select, deselect, extract, grep, fgrep, decimal),\n"
+"                             and writes the output in a background thread\n"
+"          -T <ms>            maximum time output data waits in the buffer while input is read from a pipe (default=1000),\n"
+"                             0 to only write full buffers\n"
 "          -H                 csv files have no header line\n"
 "                             columns are specified as number (first col is 0)\n"
 "          -i                 case insensitive regex (grep mode)\n"
@@ -1283,7 +1555,8 @@ static const char *usage =
 "csv concat <col1>,<col2>,... add a column with the concatenation of the specified columns\n"
 "csv rows <min>-<max>         dump selected row range from file\n"
 "csv stripheader              dump the csv files omitting the header line\n"
-"csv decimal <cols>           convert selected columns to decimal int64 representation\n"
+"csv decimal <cols>           convert selected columns from hexadecimal (0x prefix) to decimal int64 representation\n"
+"csv hex <cols>               convert selected columns from decimal to hexadecimal (0x prefix)\n"
 ;
 
 static const char *version_info =
@@ -1323,9 +1596,13 @@ int main ( int argc, char * argv[] )
 	char sep_out = ',';
 	char quot = '"';
 	unsigned line_max = 64*1024;
+	unsigned block_size = 4*1024*1024;
+	unsigned threads = 1;
 	unsigned csv_flags = 0;
+	bool gzip = false;
+	unsigned max_latency = 1000;
 
-	while ( (opt = getopt(argc, argv, "hVo:s:S:q:L:Hivu0")) != -1 )
+	while ( (opt = getopt(argc, argv, "hVo:zs:S:q:L:B:j:T:Hivu0")) != -1 )
 	{
 		switch (opt)
 		{
@@ -1341,6 +1618,10 @@ int main ( int argc, char * argv[] )
 			outfile = optarg;
 			break;
 
+		case 'z':
+			gzip = true;
+			break;
+
 		case 's':
 			sep = *optarg;
 			if ( sep == '\\' )
@@ -1364,6 +1645,28 @@ int main ( int argc, char * argv[] )
 			line_max = strtoul( optarg, NULL, 0 );
 			break;
 
+		case 'B':
+			block_size = strtoul( optarg, NULL, 0 );
+			if ( block_size == 0 )
+			{
+				std::cerr << "Invalid block size: " << optarg << std::endl << usage << std::endl;
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'j':
+			threads = strtoul( optarg, NULL, 0 );
+			if ( threads == 0 )
+			{
+				std::cerr << "Invalid thread count: " << optarg << std::endl << usage << std::endl;
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'T':
+			max_latency = strtoul( optarg, NULL, 0 );
+			break;
+
 		case 'H':
 			csv_flags |= 1 << NO_HEADERLINE;
 			break;
@@ -1396,11 +1699,15 @@ int main ( int argc, char * argv[] )
 		return EXIT_FAILURE;
 	}
 
-	output_buffer outbuf( outfile );
+	if ( output_buffer::gzip_filename( outfile ) )
+		gzip = true;
+
+	output_buffer outbuf( outfile, 64*1024, threads > 1, ( gzip ? threads : 0 ) );
 	if ( outbuf.failed_to_open() )
 		return EXIT_FAILURE;
+	outbuf.set_max_latency( max_latency );
 
-	csv_tool csv( &outbuf, sep, sep_out, quot, line_max, csv_flags );
+	csv_tool csv( &outbuf, sep, sep_out, quot, line_max, block_size, threads, csv_flags );
 
 	std::string mode = argv[optind++];
 
@@ -1605,6 +1912,23 @@ int main ( int argc, char * argv[] )
 				csv.decimal( colspec, argv[ i ] );
 		}
 	}
+	else if ( mode == "hex" )
+	{
+		if ( optind >= argc )
+		{
+			std::cerr << "No columns specified" << std::endl << usage << std::endl;
+			return EXIT_FAILURE;
+		}
+		std::string colspec = argv[ optind++ ];
+
+		if ( optind >= argc )
+			csv.decimal( colspec, NULL, true );
+		else
+		{
+			for ( int i = optind ; i < argc ; ++i )
+				csv.decimal( colspec, argv[ i ], true );
+		}
+	}
 	else
 	{
 		std::cerr << "Unsupported mode " << mode << std::endl << usage << std::endl;
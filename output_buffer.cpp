@@ -1,6 +1,17 @@
+#include <unistd.h>
 #include <string.h>
-#include <fstream>
+#include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <iostream>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
 
 #include "output_buffer.h"
 
@@ -9,29 +20,712 @@ bool output_buffer::failed_to_open ( ) const
 	return badfile;
 }
 
-void output_buffer::flush ( )
+// write data to the output, on the calling thread
+// after an error the data is dropped, the error is reported once
+void output_buffer::write_out ( const char *s, const unsigned len )
+{
+	write_out( s, len, NULL, 0 );
+}
+
+void output_buffer::write_out ( const char *s1, const unsigned len1, const char *s2, const unsigned len2 )
 {
-	if ( buf_end > 0 )
+	struct iovec v[ 2 ];
+	v[ 0 ].iov_base = (void *)s1;
+	v[ 0 ].iov_len = len1;
+	v[ 1 ].iov_base = (void *)s2;
+	v[ 1 ].iov_len = len2;
+
+	write_iov( v, ( len2 ? 2 : 1 ), false );
+}
+
+// write the data of nv iovecs to fd, modifies v
+// with splice, the data is moved to the output pipe with vmsplice(2): the pipe keeps references to the pages,
+// the data must never be modified
+void output_buffer::write_iov ( struct iovec *v, unsigned nv, bool splice )
+{
+	while ( nv > 0 && ! write_failed )
 	{
-		output->write( buf, buf_end );
+		unsigned batch = nv;
+		if ( batch > IOV_BATCH )
+			batch = IOV_BATCH;
+		ssize_t n;
+
+#ifdef __linux__
+		if ( splice )
+		{
+			n = vmsplice( fd, v, batch, 0 );
+			if ( n < 0 && errno != EINTR )
+			{
+				// not supported for this output: fall back to writev
+				splice = false;
+				continue;
+			}
+		}
+		else
+#endif
+			n = writev( fd, v, batch );
+
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			std::cerr << "write: " << strerror( errno ) << std::endl;
+			write_failed = true;
+			break;
+		}
+
+		// skip what was written, may be partial
+		while ( nv > 0 && (size_t)n >= v->iov_len )
+		{
+			n -= v->iov_len;
+			++v;
+			--nv;
+		}
+		if ( nv > 0 )
+		{
+			v->iov_base = (char *)v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+}
+
+// queue buf[buf_queued..buf_end) after the references
+void output_buffer::queue_buf ( )
+{
+	if ( buf_end == buf_queued )
+		return;
+
+	struct iovec *last = ( iov_count ? &iov[ iov_count - 1 ] : NULL );
+	if ( last && (char *)last->iov_base + last->iov_len == buf + buf_queued )
+		last->iov_len += buf_end - buf_queued;
+	else
+	{
+		iov[ iov_count ].iov_base = buf + buf_queued;
+		iov[ iov_count ].iov_len = buf_end - buf_queued;
+		++iov_count;
+	}
+
+	buf_queued = buf_end;
+}
+
+// write the queued references and buf
+void output_buffer::write_queued ( )
+{
+	queue_buf();
+
+	// vmsplice only pays for large slices: each one takes a pipe buffer slot
+	size_t total = 0;
+	unsigned nrefs = 0;
+	for ( unsigned i = 0 ; i < iov_count ; ++i )
+		if ( ! in_buf( iov[ i ].iov_base ) )
+		{
+			total += iov[ i ].iov_len;
+			++nrefs;
+		}
+
+	if ( is_pipe && iov_stable && nrefs > 0 && total >= (size_t)nrefs * SPLICE_MIN )
+	{
+		// buf is reused once written: its parts are copied to the pipe, the references are spliced
+		for ( unsigned i = 0, j ; i < iov_count ; i = j )
+		{
+			const bool ref = ! in_buf( iov[ i ].iov_base );
+			for ( j = i + 1 ; j < iov_count && ! in_buf( iov[ j ].iov_base ) == ref ; ++j )
+				;
+			write_iov( iov + i, j - i, ref );
+		}
+	}
+	else
+		write_iov( iov, iov_count, false );
+
+	iov_count = 0;
+	iov_stable = true;
+	buf_queued = 0;
+	buf_end = 0;
+}
+
+// write buf to the output and empty it, along with the queued references
+// in async mode, buf is handed to the writer thread and the spare buffer becomes buf
+void output_buffer::drain ( )
+{
+	// room for buf_size more bytes, as after a write
+	if ( to_memory )
+	{
+		if ( buf_end > 0 )
+		{
+			char *p = new char[ buf_size * 2 ];
+			memcpy( p, buf, buf_end );
+			delete[] buf;
+			buf = p;
+			buf_size *= 2;
+		}
+		return;
+	}
+
+	if ( gzip )
+	{
+		gz_submit();
+		return;
+	}
+
+	if ( iov_count > 0 )
+	{
+		write_queued();
+		return;
+	}
+
+	if ( buf_end == 0 )
+		return;
+
+	if ( ! async )
+	{
+		write_out( buf, buf_end );
 		buf_end = 0;
+		return;
+	}
+
+	pthread_mutex_lock( &lock );
+	while ( pending )
+		pthread_cond_wait( &cond, &lock );
+	pending = buf;
+	pending_len = buf_end;
+	pthread_cond_broadcast( &cond );
+	pthread_mutex_unlock( &lock );
+
+	char *tmp = buf;
+	buf = spare;
+	spare = tmp;
+	buf_end = 0;
+}
+
+// append a reference to s, written later without copy
+// s must stay valid and unchanged until release_refs() (or flush()), stable: s is never modified, even after
+// release_refs() (eg a read-only file mapping), so that it may be spliced to a pipe
+// the data is copied when writing to a stream or in async mode
+void output_buffer::append_ref ( const char *s, const unsigned len, const bool stable )
+{
+	if ( to_memory || async || gzip )
+	{
+		append( s, len );
+		return;
+	}
+
+	// the data follows the last reference: extend it
+	struct iovec *last = ( iov_count ? &iov[ iov_count - 1 ] : NULL );
+	if ( last && buf_queued == buf_end && (const char *)last->iov_base + last->iov_len == s && ! in_buf( last->iov_base ) )
+	{
+		last->iov_len += len;
+		if ( ! stable )
+			iov_stable = false;
+		return;
 	}
 
-	output->flush();
+	// a copy is cheaper than an iovec for small data
+	if ( len < REF_MIN )
+	{
+		append( s, len );
+		return;
+	}
+
+	if ( ! iov )
+		iov = new struct iovec[ IOV_QUEUE ];
+
+	// room for buf before and after the reference
+	if ( iov_count + 3 > IOV_QUEUE )
+		write_queued();
+
+	queue_buf();
+
+	iov[ iov_count ].iov_base = (void *)s;
+	iov[ iov_count ].iov_len = len;
+	++iov_count;
+
+	if ( ! stable )
+		iov_stable = false;
+}
+
+#ifndef NO_ZLIB
+// an empty bgzf member, marks the end of a bgzf file
+static const unsigned char bgzf_eof[ 28 ] = {
+	0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// compress data[0..len) as bgzf members into out, return the compressed length
+// out needs GZ_MEMBER_MAX bytes per GZ_BLOCK of data
+unsigned output_buffer::gz_compress ( z_stream *zs, const char *data, const unsigned len, char *out )
+{
+	// gzip header with the 'BC' extra subfield, holding the member size - 1
+	static const unsigned char header[ 16 ] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0 };
+	unsigned zlen = 0;
+
+	for ( unsigned off = 0 ; off < len ; off += GZ_BLOCK )
+	{
+		unsigned n = ( len - off > GZ_BLOCK ? (unsigned)GZ_BLOCK : len - off );
+		unsigned char *m = (unsigned char *)out + zlen;
+
+		memcpy( m, header, 16 );
+
+		deflateReset( zs );
+		zs->next_in = (Bytef *)data + off;
+		zs->avail_in = n;
+		zs->next_out = m + 18;
+		zs->avail_out = GZ_MEMBER_MAX - 26;
+		if ( deflate( zs, Z_FINISH ) != Z_STREAM_END )
+			std::cerr << "deflate: " << ( zs->msg ? zs->msg : "member overflow" ) << std::endl;
+
+		unsigned char *t = zs->next_out;
+		uLong crc = crc32( 0, (const Bytef *)data + off, n );
+		for ( unsigned i = 0 ; i < 4 ; ++i )
+		{
+			t[ i ] = crc >> ( 8*i );
+			t[ 4 + i ] = n >> ( 8*i );
+		}
+
+		unsigned size = t + 8 - m;
+		m[ 16 ] = ( size - 1 ) & 0xff;
+		m[ 17 ] = ( size - 1 ) >> 8;
+		zlen += size;
+	}
+
+	return zlen;
+}
+
+// compress buf, or hand it to the workers
+void output_buffer::gz_submit ( )
+{
+	if ( buf_end == 0 )
+		return;
+
+	if ( ! gz_nworkers )
+	{
+		write_out( gz[ 0 ].zdata, gz_compress( gz_stream, buf, buf_end, gz[ 0 ].zdata ) );
+		buf_end = 0;
+		return;
+	}
+
+	gz_write( gz_nslots - 1 );
+
+	gz_slot *s = &gz[ ( gz_head + gz_count ) % gz_nslots ];
+	char *tmp = s->data;
+	s->data = buf;
+	s->len = buf_end;
+	buf = tmp;
+	buf_end = 0;
+
+	pthread_mutex_lock( &lock );
+	s->state = GZ_TODO;
+	++gz_count;
+	pthread_cond_broadcast( &cond );
+	pthread_mutex_unlock( &lock );
+
+	// write what is ready, without waiting
+	gz_write( gz_nslots );
+}
+
+// write the compressed slots at the head of the ring, waiting for them until at most keep slots are in use
+void output_buffer::gz_write ( const unsigned keep )
+{
+	if ( ! gz_nworkers )
+		return;
+
+	pthread_mutex_lock( &lock );
+	while ( gz_count > 0 )
+	{
+		gz_slot *s = &gz[ gz_head ];
+
+		if ( s->state != GZ_DONE )
+		{
+			if ( gz_count <= keep )
+				break;
+
+			pthread_cond_wait( &cond, &lock );
+			continue;
+		}
+
+		pthread_mutex_unlock( &lock );
+		write_out( s->zdata, s->zlen );
+		pthread_mutex_lock( &lock );
+
+		s->state = GZ_FREE;
+		gz_head = ( gz_head + 1 ) % gz_nslots;
+		--gz_count;
+	}
+	pthread_mutex_unlock( &lock );
+}
+
+// compression worker main loop: compress the slots to do, in any order
+void output_buffer::gz_loop ( )
+{
+	z_stream zs;
+	memset( &zs, 0, sizeof(zs) );
+	if ( deflateInit2( &zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+	{
+		std::cerr << "deflateInit: " << ( zs.msg ? zs.msg : "failed" ) << std::endl;
+		return;
+	}
+
+	pthread_mutex_lock( &lock );
+	for (;;)
+	{
+		gz_slot *s = NULL;
+		while ( ! stop )
+		{
+			for ( unsigned i = 0 ; i < gz_count && ! s ; ++i )
+				if ( gz[ ( gz_head + i ) % gz_nslots ].state == GZ_TODO )
+					s = &gz[ ( gz_head + i ) % gz_nslots ];
+			if ( s )
+				break;
+			pthread_cond_wait( &cond, &lock );
+		}
+		if ( stop )
+			break;
+
+		s->state = GZ_BUSY;
+		pthread_mutex_unlock( &lock );
+
+		s->zlen = gz_compress( &zs, s->data, s->len, s->zdata );
+
+		pthread_mutex_lock( &lock );
+		s->state = GZ_DONE;
+		pthread_cond_broadcast( &cond );
+	}
+	pthread_mutex_unlock( &lock );
+
+	deflateEnd( &zs );
+}
+
+void *output_buffer::gz_thread ( void *arg )
+{
+	((output_buffer *)arg)->gz_loop();
+	return NULL;
+}
+
+void output_buffer::start_gzip ( const unsigned threads )
+{
+	gzip = true;
+
+	// whole members per buffer
+	buf_size = ( buf_size + GZ_BLOCK - 1 ) / GZ_BLOCK * GZ_BLOCK;
+	delete[] buf;
+	buf = new char[buf_size];
+
+	gz_nworkers = ( threads > 1 ? threads : 0 );
+	gz_nslots = ( gz_nworkers ? 2 * gz_nworkers : 1 );
+	gz = new gz_slot[ gz_nslots ];
+	for ( unsigned i = 0 ; i < gz_nslots ; ++i )
+	{
+		gz[ i ].data = ( gz_nworkers ? new char[buf_size] : NULL );
+		gz[ i ].len = 0;
+		gz[ i ].zdata = new char[ buf_size / GZ_BLOCK * GZ_MEMBER_MAX ];
+		gz[ i ].zlen = 0;
+		gz[ i ].state = GZ_FREE;
+	}
+
+	if ( gz_nworkers )
+	{
+		stop = false;
+		pthread_mutex_init( &lock, NULL );
+		pthread_cond_init( &cond, NULL );
+
+		gz_workers = new pthread_t[ gz_nworkers ];
+		unsigned n = 0;
+		for ( ; n < gz_nworkers ; ++n )
+			if ( pthread_create( &gz_workers[ n ], NULL, gz_thread, this ) )
+				break;
+
+		if ( n > 0 )
+		{
+			gz_nworkers = n;
+			return;
+		}
+
+		std::cerr << "Cannot start compression threads: " << strerror( errno ) << std::endl;
+		pthread_cond_destroy( &cond );
+		pthread_mutex_destroy( &lock );
+		delete[] gz_workers;
+		gz_workers = NULL;
+		gz_nworkers = 0;
+	}
+
+	gz_stream = new z_stream;
+	memset( gz_stream, 0, sizeof(*gz_stream) );
+	if ( deflateInit2( gz_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+	{
+		std::cerr << "deflateInit: " << ( gz_stream->msg ? gz_stream->msg : "failed" ) << std::endl;
+		badfile = true;
+	}
+}
+#else
+void output_buffer::gz_submit ( ) { }
+void output_buffer::gz_write ( const unsigned ) { }
+
+void output_buffer::start_gzip ( const unsigned )
+{
+	std::cerr << "Compressed output is not supported (built with NO_ZLIB)" << std::endl;
+	badfile = true;
+}
+#endif
+
+// return true if filename asks for a compressed output (ends with .gz)
+bool output_buffer::gzip_filename ( const char *filename )
+{
+	size_t len = ( filename ? strlen( filename ) : 0 );
+
+	return len > 3 && ! strcmp( filename + len - 3, ".gz" );
+}
+
+// write the references queued by append_ref(), before their data changes
+void output_buffer::release_refs ( )
+{
+	if ( iov_count > 0 )
+		write_queued();
+}
+
+// move the data of in_fd, from offset (-1: from its current position) to its end, to fd inside the kernel
+// copy_file_range(2) needs two regular files, sendfile(2) a regular input file, splice(2) a pipe on either side
+// return false if no method applies to these files (before any data is moved), true when done or on error
+bool output_buffer::move_fd ( int in_fd, off_t offset, off_t len )
+{
+#ifdef __linux__
+	enum {
+		MOVE_CHUNK = 1024*1024*1024,
+	};
+
+	off_t off = offset;
+	off_t *poff = ( offset == -1 ? NULL : &off );
+	bool moved = false;
+
+	for ( int method = 0 ; method < 3 ; ++method )
+	{
+		for (;;)
+		{
+			ssize_t n;
+			size_t chunk = ( len != -1 && len < MOVE_CHUNK ? (size_t)len : (size_t)MOVE_CHUNK );
+
+			if ( len == 0 )
+				return true;
+
+			if ( method == 0 )
+				n = copy_file_range( in_fd, poff, fd, NULL, chunk, 0 );
+			else if ( method == 1 )
+				n = sendfile( fd, in_fd, poff, chunk );
+			else
+				n = splice( in_fd, poff, fd, NULL, chunk, SPLICE_F_MOVE );
+
+			if ( n > 0 )
+			{
+				moved = true;
+				if ( len != -1 )
+					len -= n;
+				continue;
+			}
+
+			if ( n == 0 )
+				return true;
+
+			if ( errno == EINTR )
+				continue;
+
+			// not supported for these files: try the next method
+			if ( ! moved && ( errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF ) )
+				break;
+
+			std::cerr << "copy: " << strerror( errno ) << std::endl;
+			write_failed = true;
+			return true;
+		}
+	}
+#else
+	(void)in_fd;
+	(void)offset;
+	(void)len;
+#endif
+
+	return false;
+}
+
+void output_buffer::append_fd ( int in_fd, off_t offset, off_t len )
+{
+	if ( ! to_memory && ! gzip )
+	{
+		drain();
+		wait_writer();
+
+		if ( write_failed || move_fd( in_fd, offset, len ) )
+			return;
+	}
+
+	// read through buf
+	while ( len != 0 )
+	{
+		ssize_t n;
+		size_t chunk = buf_size - buf_end;
+		if ( len != -1 && (off_t)chunk > len )
+			chunk = len;
+
+		if ( offset == -1 )
+			n = read( in_fd, buf + buf_end, chunk );
+		else
+			n = pread( in_fd, buf + buf_end, chunk, offset );
+
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			std::cerr << "read: " << strerror( errno ) << std::endl;
+			break;
+		}
+
+		if ( n == 0 )
+			break;
+
+		buf_end += n;
+		if ( offset != -1 )
+			offset += n;
+		if ( len != -1 )
+			len -= n;
+
+		if ( buf_end == buf_size )
+			drain();
+	}
+}
+
+// wait until the writer thread is idle
+void output_buffer::wait_writer ( )
+{
+	if ( ! async )
+		return;
+
+	pthread_mutex_lock( &lock );
+	while ( pending )
+		pthread_cond_wait( &cond, &lock );
+	pthread_mutex_unlock( &lock );
+}
+
+void output_buffer::write_loop ( )
+{
+	pthread_mutex_lock( &lock );
+	for (;;)
+	{
+		while ( ! pending && ! stop )
+			pthread_cond_wait( &cond, &lock );
+		if ( ! pending )
+			break;
+		pthread_mutex_unlock( &lock );
+
+		write_out( pending, pending_len );
+
+		pthread_mutex_lock( &lock );
+		pending = NULL;
+		pthread_cond_broadcast( &cond );
+	}
+	pthread_mutex_unlock( &lock );
+}
+
+void *output_buffer::writer_thread ( void *arg )
+{
+	((output_buffer *)arg)->write_loop();
+	return NULL;
+}
+
+void output_buffer::start_writer ( )
+{
+	spare = new char[buf_size];
+	pending = NULL;
+	pending_len = 0;
+	stop = false;
+	pthread_mutex_init( &lock, NULL );
+	pthread_cond_init( &cond, NULL );
+
+	if ( pthread_create( &writer, NULL, writer_thread, this ) )
+	{
+		std::cerr << "Cannot start writer thread: " << strerror( errno ) << std::endl;
+		pthread_cond_destroy( &cond );
+		pthread_mutex_destroy( &lock );
+		delete[] spare;
+		spare = NULL;
+		return;
+	}
+
+	async = true;
+}
+
+void output_buffer::flush ( )
+{
+	if ( to_memory )
+		return;
+
+	drain();
+	wait_writer();
+	gz_write( 0 );
+}
+
+// milliseconds of a monotonic clock, the coarse clock is read without a syscall on linux
+static unsigned long long clock_ms ( )
+{
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+#else
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+#endif
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void output_buffer::set_max_latency ( const unsigned ms )
+{
+	max_latency = ms;
+	latency_armed = false;
+}
+
+// the age of the data is counted from the first call that sees it, so the caller should run this at least every
+// time it waits for input
+unsigned output_buffer::latency_left ( )
+{
+	if ( max_latency == 0 || ( buf_end == 0 && iov_count == 0 && gz_count == 0 ) )
+	{
+		latency_armed = false;
+		return ~0U;
+	}
+
+	unsigned long long now = clock_ms();
+	if ( ! latency_armed )
+	{
+		latency_armed = true;
+		pending_since = now;
+	}
+	else if ( now - pending_since >= max_latency )
+	{
+		flush();
+		latency_armed = false;
+		return ~0U;
+	}
+
+	return max_latency - ( now - pending_since );
 }
 
 void output_buffer::append ( const char *s, const unsigned len )
 {
 	unsigned len_left = len;
 
-	while ( len_left >= buf_size - buf_end )
+	// large data: written along with the buffer, without copy
+	if ( len_left >= buf_size && ! async && ! gzip && ! to_memory )
 	{
-		if ( buf_end < buf_size )
-			memcpy( buf + buf_end, s, buf_size - buf_end );
-		output->write( buf, buf_size );
-		len_left -= buf_size - buf_end;
-		s += buf_size - buf_end;
+		release_refs();
+		write_out( buf, buf_end, s, len_left );
 		buf_end = 0;
+		return;
+	}
+
+	while ( len_left >= buf_size - buf_end )
+	{
+		unsigned n = buf_size - buf_end;
+		memcpy( buf + buf_end, s, n );
+		buf_end = buf_size;
+		drain();
+		len_left -= n;
+		s += n;
 	}
 
 	if ( len_left > 0 )
@@ -65,37 +759,324 @@ void output_buffer::append_nl ( )
 	append( '\n' );
 }
 
-output_buffer::output_buffer ( const char *filename, const unsigned buf_size ) :
+static const char digit_pairs[ 201 ] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// number of decimal digits of v
+static unsigned dec_digits ( unsigned long long v )
+{
+	unsigned n = 1;
+
+	for (;;)
+	{
+		if ( v < 10 )
+			return n;
+		if ( v < 100 )
+			return n + 1;
+		if ( v < 1000 )
+			return n + 2;
+		if ( v < 10000 )
+			return n + 3;
+
+		v /= 10000;
+		n += 4;
+	}
+}
+
+// write the decimal digits of v backwards from end, two at a time
+static void put_dec ( char *end, unsigned long long v )
+{
+	while ( v >= 100 )
+	{
+		unsigned i = ( v % 100 ) * 2;
+		v /= 100;
+		end -= 2;
+		end[ 0 ] = digit_pairs[ i ];
+		end[ 1 ] = digit_pairs[ i + 1 ];
+	}
+
+	if ( v >= 10 )
+	{
+		end[ -2 ] = digit_pairs[ v * 2 ];
+		end[ -1 ] = digit_pairs[ v * 2 + 1 ];
+	}
+	else
+		end[ -1 ] = '0' + v;
+}
+
+void output_buffer::append_uint ( const unsigned long long v )
+{
+	unsigned n = dec_digits( v );
+
+	// formatted in place when it fits
+	if ( buf_size - buf_end > n )
+	{
+		put_dec( buf + buf_end + n, v );
+		buf_end += n;
+		return;
+	}
+
+	char tmp[ 20 ];
+	put_dec( tmp + n, v );
+	append( tmp, n );
+}
+
+void output_buffer::append_int ( const long long v )
+{
+	if ( v < 0 )
+	{
+		append( '-' );
+		append_uint( 0ULL - (unsigned long long)v );
+	}
+	else
+		append_uint( v );
+}
+
+void output_buffer::append_hex ( const unsigned long long v, const unsigned width )
+{
+	static const char hex_digits[ 17 ] = "0123456789abcdef";
+
+	unsigned n = ( 64 - __builtin_clzll( v | 1 ) + 3 ) / 4;
+	if ( n < width )
+		n = ( width > 16 ? 16 : width );
+
+	char tmp[ 16 ];
+	char *dst = ( buf_size - buf_end > n ? buf + buf_end : tmp );
+
+	unsigned long long x = v;
+	for ( unsigned i = n ; i > 0 ; --i, x >>= 4 )
+		dst[ i - 1 ] = hex_digits[ x & 15 ];
+
+	if ( dst == tmp )
+		append( tmp, n );
+	else
+		buf_end += n;
+}
+
+// append s as a csv field: in quotes, with its quotes doubled, nothing if s is empty
+// same output as csv_reader::escape_csv_string(), without the temporary string
+void output_buffer::append_escaped ( const char *s, const unsigned len, const char quot )
+{
+	if ( len == 0 )
+		return;
+
+	// room for the worst case, all quotes
+	unsigned room = buf_size - buf_end;
+	if ( room < 2 || len > ( room - 2 ) / 2 )
+	{
+		if ( buf_end > 0 && len <= ( buf_size - 2 ) / 2 )
+			drain();
+		else
+		{
+			append( quot );
+			append_escaped_data( s, len, quot );
+			append( quot );
+			return;
+		}
+	}
+
+	// write in place
+	char *out = buf + buf_end;
+	const char *end = s + len;
+	const char *q;
+
+	*out++ = quot;
+	while ( ( q = (const char *)memchr( s, quot, end - s ) ) )
+	{
+		++q;
+		memcpy( out, s, q - s );
+		out += q - s;
+		*out++ = quot;
+		s = q;
+	}
+	memcpy( out, s, end - s );
+	out += end - s;
+	*out++ = quot;
+
+	buf_end = out - buf;
+}
+
+void output_buffer::append_escaped ( const std::string &str, const char quot )
+{
+	append_escaped( str.data(), str.size(), quot );
+}
+
+// append s with its quotes doubled, without the surrounding quotes
+void output_buffer::append_escaped_data ( const char *s, unsigned len, const char quot )
+{
+	const char *q;
+
+	while ( len > 0 && ( q = (const char *)memchr( s, quot, len ) ) )
+	{
+		++q;
+		append( s, q - s );
+		append( quot );
+		len -= q - s;
+		s = q;
+	}
+
+	if ( len > 0 )
+		append( s, len );
+}
+
+// memory output: return the data appended so far, and its length in len, valid until the next append
+const char *output_buffer::memory ( unsigned *len ) const
+{
+	*len = buf_end;
+	return buf;
+}
+
+// memory output: drop the data, the buffer is kept for the next appends
+void output_buffer::clear ( )
+{
+	buf_end = 0;
+}
+
+output_buffer::output_buffer ( const char *filename, const unsigned buf_size, const bool async, const unsigned gzip_threads ) :
+	to_memory(false),
+	fd(1),
+	should_close_fd(false),
 	badfile(false),
+	write_failed(false),
 	buf_end(0),
-	buf_size(buf_size)
+	buf_size(buf_size),
+	async(false),
+	spare(NULL),
+	iov(NULL),
+	iov_count(0),
+	iov_stable(true),
+	buf_queued(0),
+	is_pipe(false),
+	gzip(false),
+	gz(NULL),
+	gz_nslots(0),
+	gz_head(0),
+	gz_count(0),
+	gz_workers(NULL),
+	gz_nworkers(0),
+	gz_stream(NULL),
+	max_latency(0),
+	latency_armed(false),
+	pending_since(0)
 {
 	buf = new char[buf_size];
 
 	if ( filename )
 	{
-		should_delete_output = true;
-		output = new std::ofstream(filename);
-		if ( ! *output )
+		fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+		if ( fd < 0 )
 		{
 			std::cerr << "Cannot open " << filename << ": " << strerror( errno ) << std::endl;
 			badfile = true;
 			return;
 		}
+		should_close_fd = true;
 	}
-	else
-	{
-		should_delete_output = false;
-		output = &std::cout;
-	}
+
+	struct stat st;
+	is_pipe = ( ! fstat( fd, &st ) && S_ISFIFO( st.st_mode ) );
+
+	if ( gzip_threads )
+		start_gzip( gzip_threads );
+	else if ( async )
+		start_writer();
+}
+
+// keep the output in memory, in a buffer of buf_size bytes that grows as needed
+output_buffer::output_buffer ( const unsigned buf_size ) :
+	to_memory(true),
+	fd(-1),
+	should_close_fd(false),
+	badfile(false),
+	write_failed(false),
+	buf_end(0),
+	buf_size(buf_size),
+	async(false),
+	spare(NULL),
+	iov(NULL),
+	iov_count(0),
+	iov_stable(true),
+	buf_queued(0),
+	is_pipe(false),
+	gzip(false),
+	gz(NULL),
+	gz_nslots(0),
+	gz_head(0),
+	gz_count(0),
+	gz_workers(NULL),
+	gz_nworkers(0),
+	gz_stream(NULL),
+	max_latency(0),
+	latency_armed(false),
+	pending_since(0)
+{
+	buf = new char[buf_size];
 }
 
 output_buffer::~output_buffer ( )
 {
-	flush();
+	if ( ! badfile )
+	{
+		flush();
+#ifndef NO_ZLIB
+		if ( gzip )
+			write_out( (const char *)bgzf_eof, sizeof(bgzf_eof) );
+#endif
+	}
+
+	if ( gz_nworkers )
+	{
+		pthread_mutex_lock( &lock );
+		stop = true;
+		pthread_cond_broadcast( &cond );
+		pthread_mutex_unlock( &lock );
+		for ( unsigned i = 0 ; i < gz_nworkers ; ++i )
+			pthread_join( gz_workers[ i ], NULL );
+
+		pthread_cond_destroy( &cond );
+		pthread_mutex_destroy( &lock );
+	}
+
+	for ( unsigned i = 0 ; i < gz_nslots ; ++i )
+	{
+		delete[] gz[ i ].data;
+		delete[] gz[ i ].zdata;
+	}
+	delete[] gz;
+	delete[] gz_workers;
+#ifndef NO_ZLIB
+	if ( gz_stream )
+	{
+		deflateEnd( gz_stream );
+		delete gz_stream;
+	}
+#endif
+
+	if ( async )
+	{
+		pthread_mutex_lock( &lock );
+		stop = true;
+		pthread_cond_broadcast( &cond );
+		pthread_mutex_unlock( &lock );
+		pthread_join( writer, NULL );
+
+		pthread_cond_destroy( &cond );
+		pthread_mutex_destroy( &lock );
+	}
 
-	if ( should_delete_output )
-		delete output;
+	if ( should_close_fd && close( fd ) )
+		std::cerr << "close: " << strerror( errno ) << std::endl;
 
+	delete[] iov;
+	delete[] spare;
 	delete[] buf;
 }
@@ -1,19 +1,115 @@
 #ifndef OUTPUT_BUFFER_H
 #define OUTPUT_BUFFER_H
 
-#include <iostream>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+
+struct z_stream_s;
 
 class output_buffer
 {
 private:
-	std::ostream *output;
-	bool should_delete_output;
+	bool to_memory;	// the output is kept in buf, which grows to hold it
+	int fd;
+	bool should_close_fd;
 	bool badfile;
+	bool write_failed;
 
 	unsigned buf_end;
 	unsigned buf_size;
 	char *buf;
 
+	// async mode: a full buffer is handed to the writer thread, and filling goes on in the other one
+	bool async;
+	char *spare;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const char *pending;	// buffer being written by the writer thread, NULL if none
+	unsigned pending_len;
+	bool stop;
+
+	// references queued by append_ref(), and the parts of buf between them
+	enum {
+		IOV_QUEUE = 1024,
+		IOV_BATCH = 1024,	// iovecs per writev(2), IOV_MAX on linux
+		REF_MIN = 256,	// shorter data is copied, unless it extends the last reference
+		SPLICE_MIN = 4096,	// average slice size to use vmsplice(2)
+	};
+	struct iovec *iov;
+	unsigned iov_count;
+	bool iov_stable;	// the queued references are never modified
+	unsigned buf_queued;	// buf[0..buf_queued) is queued in iov
+	bool is_pipe;
+
+	bool in_buf ( const void *p ) const { return (const char *)p >= buf && (const char *)p < buf + buf_size; }
+
+	// gzip mode: the output is compressed as bgzf, gzip members of up to 64 KB of data that line_reader can inflate
+	// in parallel; full buffers are swapped into a ring of slots, compressed by worker threads, and written in order
+	// by the calling thread
+	enum {
+		GZ_BLOCK = 0xff00,	// data per member, so that a compressed member always fits in 64 KB
+		GZ_MEMBER_MAX = 64*1024,
+	};
+	enum {
+		GZ_FREE,
+		GZ_TODO,
+		GZ_BUSY,
+		GZ_DONE,
+	};
+	struct gz_slot {
+		char *data;	// buf_size bytes, swapped with buf
+		unsigned len;
+		char *zdata;
+		unsigned zlen;
+		int state;
+	};
+	bool gzip;
+	gz_slot *gz;
+	unsigned gz_nslots;
+	unsigned gz_head;	// next slot to write
+	unsigned gz_count;	// number of slots in use
+	pthread_t *gz_workers;
+	unsigned gz_nworkers;
+	struct z_stream_s *gz_stream;	// compression on the calling thread, when there are no workers
+
+	void start_gzip ( const unsigned threads );
+	// compress buf, or hand it to the workers
+	void gz_submit ( );
+	// write the compressed slots at the head of the ring, waiting for them until at most keep slots are in use
+	void gz_write ( const unsigned keep );
+	void gz_loop ( );
+	static void *gz_thread ( void *arg );
+	// compress data[0..len) as bgzf members into out, return the compressed length
+	static unsigned gz_compress ( struct z_stream_s *zs, const char *data, const unsigned len, char *out );
+
+	// latency limit: data found pending by latency_left() is flushed max_latency ms later
+	unsigned max_latency;	// 0: no limit
+	bool latency_armed;	// data was pending at the last latency_left()
+	unsigned long long pending_since;	// ms, when latency_left() first saw it
+
+	// write data to the output, on the calling thread
+	void write_out ( const char *s, const unsigned len );
+	void write_out ( const char *s1, const unsigned len1, const char *s2, const unsigned len2 );
+	void write_iov ( struct iovec *v, unsigned nv, bool splice );
+
+	void queue_buf ( );
+	void write_queued ( );
+
+	// move the data of in_fd to the output inside the kernel, see append_fd()
+	bool move_fd ( int in_fd, off_t offset, off_t len );
+
+	// write buf to the output and empty it (the writer thread writes it in async mode), or grow it for a memory output
+	void drain ( );
+	// wait until the writer thread is idle
+	void wait_writer ( );
+
+	void start_writer ( );
+	void write_loop ( );
+	static void *writer_thread ( void *arg );
+
 public:
 	bool failed_to_open ( ) const;
 	void flush ( );
@@ -22,9 +118,49 @@ public:
 	void append ( const std::string &str );
 	void append ( const char c );
 	void append_nl ( );
-	explicit output_buffer ( const char *filename, const unsigned buf_size = 64*1024 );
+	// append a reference to s, written later without copy (writev(2), or vmsplice(2) to a pipe)
+	// s must stay valid and unchanged until release_refs() or flush()
+	// stable: s is never modified, even after release_refs(), so that it may be spliced
+	void append_ref ( const char *s, const unsigned len, const bool stable = false );
+	// write the references queued by append_ref(), before their data changes
+	void release_refs ( );
+	// append len bytes of in_fd (-1: up to its end), from offset (-1: from its current position)
+	// the data is moved by the kernel when the files allow it (copy_file_range(2), sendfile(2), splice(2)),
+	// otherwise it is read and copied
+	void append_fd ( int in_fd, off_t offset, off_t len = -1 );
+	// flush the data left in the buffer for more than ms milliseconds (0, default: no limit), see latency_left()
+	void set_max_latency ( const unsigned ms );
+	// flush if data has been waiting in the buffer for the maximum latency, return the time in ms left before the
+	// data waiting must be flushed, ~0U if none is waiting (or if there is no limit)
+	// cheap (reads a coarse clock): meant to be called when the input stalls, see csv_reader::set_idle_hook()
+	unsigned latency_left ( );
+	// append the decimal representation of v
+	void append_uint ( const unsigned long long v );
+	void append_int ( const long long v );
+	// append v in lowercase hexadecimal, without prefix, zero padded to at least width digits
+	void append_hex ( const unsigned long long v, const unsigned width = 1 );
+	// append s as a csv field: in quotes, with its quotes doubled, nothing if s is empty
+	void append_escaped ( const char *s, const unsigned len, const char quot = '"' );
+	void append_escaped ( const std::string &str, const char quot = '"' );
+	// append s with its quotes doubled, without the surrounding quotes
+	void append_escaped_data ( const char *s, unsigned len, const char quot = '"' );
+	// memory output: return the data appended so far, and its length in len, valid until the next append
+	const char *memory ( unsigned *len ) const;
+	// memory output: drop the data, the buffer is kept for the next appends
+	void clear ( );
+	// write to filename, or to stdout if NULL, with write(2) / writev(2)
+	// async: writes run in a background thread, while the next buffer is filled (uses twice buf_size)
+	// gzip_threads: compress the output as gzip (bgzf) on that many threads (1: on the calling thread), 0 for plain
+	// output ; async is then ignored
+	explicit output_buffer ( const char *filename, const unsigned buf_size = 64*1024, const bool async = false, const unsigned gzip_threads = 0 );
+	// keep the output in memory, in a buffer of buf_size bytes that grows as needed, see memory()
+	// append_ref() copies the data
+	explicit output_buffer ( const unsigned buf_size );
 	~output_buffer ( );
 
+	// return true if filename asks for a compressed output (ends with .gz)
+	static bool gzip_filename ( const char *filename );
+
 private:
 	output_buffer ( const output_buffer& );
 	output_buffer& operator=( const output_buffer& );
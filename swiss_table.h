@@ -0,0 +1,288 @@
+#ifndef SWISS_TABLE_H
+#define SWISS_TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#if defined(__GNUC__) && defined(__SSE2__)
+#define SWISS_TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "mmap_alloc.h"
+
+/*
+ * Open addressing hash table, an alternative to page_tree when there are millions of entries
+ * It stores the same kind of data (values of a fixed size, indexed by a uint64_t hash which may be duplicated), but
+ * the entries are not sorted: iter_next() returns them in table order
+ *
+ * The slots are split in groups of 16, each slot having a control byte: 0x80 if empty, 0xfe if moved to a bigger table,
+ * otherwise 7 bits of the entry index (its tag)
+ * A lookup compares the tag to the 16 control bytes of a group at once (SSE2), checks the full index of the matching
+ * slots, and visits the groups by quadratic probing until a group holding an empty slot
+ * Entries are never removed, so an insertion takes the first empty slot of the probe sequence
+ *
+ * The table grows when it is 7/8 full: a table twice as big is allocated, and each following insertion moves a few
+ * groups of the old table into it, so that there is no long pause ; until the old table is empty, lookups visit both
+ * Each table is allocated by its own mmap_alloc (which may be backed by swap files), released once the table is empty
+ *
+ * Layout of a table: control bytes, then indexes, then values, so that a probe only reads one cache line of control
+ * bytes per group
+ */
+
+class swiss_table
+{
+public:
+	typedef uint64_t t_idx;
+
+	/* iterator state, for iter_next() / iter_next_hash() */
+	struct iter {
+		unsigned table;	/* 0: current table, 1: old table, 2: end */
+		size_t pos;	/* current group for iter_next_hash(), slot for iter_next() */
+		size_t step;	/* number of groups probed */
+		unsigned mask;	/* slots of the current group left to check */
+	};
+
+private:
+	enum {
+		GROUP = 16,
+		CTRL_EMPTY = 0x80,
+		CTRL_MOVED = 0xfe,
+		MIN_GROUPS = 64,
+		MOVE_GROUPS = 4,	/* groups of the old table moved per insertion while growing */
+	};
+
+	struct table {
+		mmap_alloc *mem;
+		uint8_t *ctrl;
+		t_idx *idx;
+		char *values;
+		size_t ngroups;	/* power of 2, 0 if the table is not allocated */
+		size_t count;
+	};
+
+	std::string mmap_dir;
+	unsigned value_size;
+	table cur;
+	table old;	/* being moved into cur */
+	size_t old_moved;	/* groups of old already moved */
+
+	static uint8_t idx_tag( t_idx idx )
+	{
+		return idx & 0x7f;
+	}
+
+	static size_t home_group( const table &t, t_idx idx )
+	{
+		return ( idx >> 7 ) & ( t.ngroups - 1 );
+	}
+
+	/* bitmask of the slots of a group whose control byte is c */
+	static unsigned group_match( const uint8_t *ctrl, uint8_t c )
+	{
+#ifdef SWISS_TABLE_SSE2
+		__m128i g = _mm_load_si128( (const __m128i *)ctrl );
+		return _mm_movemask_epi8( _mm_cmpeq_epi8( g, _mm_set1_epi8( c ) ) );
+#else
+		unsigned m = 0;
+		for ( unsigned i = 0 ; i < GROUP ; ++i )
+			m |= (unsigned)( ctrl[ i ] == c ) << i;
+		return m;
+#endif
+	}
+
+	void alloc_table( table *t, size_t ngroups )
+	{
+		size_t nslots = ngroups * GROUP;
+		size_t size = nslots * ( 1 + sizeof(t_idx) + value_size );
+
+		t->mem = new mmap_alloc( mmap_dir, size, size );
+		char *p = (char *)t->mem->alloc( size, GROUP );
+		if ( !p )
+			throw std::bad_alloc();
+
+		t->ctrl = (uint8_t *)p;
+		t->idx = (t_idx *)( p + nslots );
+		t->values = (char *)( t->idx + nslots );
+		t->ngroups = ngroups;
+		t->count = 0;
+
+		memset( t->ctrl, CTRL_EMPTY, nslots );
+	}
+
+	void free_table( table *t )
+	{
+		delete t->mem;
+		t->mem = NULL;
+		t->ngroups = 0;
+		t->count = 0;
+	}
+
+	/* store idx in the first empty slot of its probe sequence in t, return the value */
+	void *place( table &t, t_idx idx )
+	{
+		size_t g = home_group( t, idx );
+		for ( size_t step = 1 ; ; ++step )
+		{
+			unsigned m = group_match( t.ctrl + g * GROUP, CTRL_EMPTY );
+			if ( m )
+			{
+				size_t slot = g * GROUP + __builtin_ctz( m );
+				t.ctrl[ slot ] = idx_tag( idx );
+				t.idx[ slot ] = idx;
+				++t.count;
+
+				return t.values + slot * value_size;
+			}
+
+			g = ( g + step ) & ( t.ngroups - 1 );
+		}
+	}
+
+	/* move up to n groups of the old table to the current one */
+	void move_groups( size_t n )
+	{
+		for ( ; n > 0 && old_moved < old.ngroups ; --n, ++old_moved )
+			for ( size_t slot = old_moved * GROUP ; slot < ( old_moved + 1 ) * GROUP ; ++slot )
+				if ( !( old.ctrl[ slot ] & 0x80 ) )
+				{
+					memcpy( place( cur, old.idx[ slot ] ), old.values + slot * value_size, value_size );
+					old.ctrl[ slot ] = CTRL_MOVED;
+				}
+
+		if ( old.ngroups && old_moved == old.ngroups )
+			free_table( &old );
+	}
+
+	void grow()
+	{
+		/* moving MOVE_GROUPS groups per insertion empties the old table long before this one is full */
+		move_groups( old.ngroups );
+
+		old = cur;
+		old_moved = 0;
+		alloc_table( &cur, old.ngroups * 2 );
+	}
+
+public:
+	explicit swiss_table( const std::string &mmap_dir ) :
+		mmap_dir(mmap_dir),
+		value_size(0),
+		old_moved(0)
+	{
+		cur.mem = old.mem = NULL;
+		cur.ngroups = old.ngroups = 0;
+		cur.count = old.count = 0;
+	}
+
+	~swiss_table()
+	{
+		free_table( &old );
+		free_table( &cur );
+	}
+
+	/*
+	 * sets the size in bytes of every value of the table
+	 * must be called once, before any insertion in the table
+	 */
+	void set_value_size( unsigned sz )
+	{
+		value_size = sz;
+		alloc_table( &cur, MIN_GROUPS );
+	}
+
+	/*
+	 * insert a new entry, allocates the value
+	 * returns the pointer to the value, valid until the next insertion
+	 */
+	void *insert( t_idx idx )
+	{
+		if ( old.ngroups )
+			move_groups( MOVE_GROUPS );
+
+		if ( cur.count + 1 > cur.ngroups * GROUP / 8 * 7 )
+			grow();
+
+		return place( cur, idx );
+	}
+
+	/* initializes an iterator for iter_next() */
+	void iter_init( iter *it )
+	{
+		it->table = ( old.ngroups ? 1 : 0 );
+		it->pos = 0;
+	}
+
+	/* when called repeatedly, returns all values of the table, in no particular order */
+	void *iter_next( iter *it )
+	{
+		for (;;)
+		{
+			if ( it->table > 1 )
+				return NULL;
+
+			table &t = ( it->table == 1 ? old : cur );
+			while ( it->pos < t.ngroups * GROUP )
+			{
+				size_t slot = it->pos++;
+				if ( !( t.ctrl[ slot ] & 0x80 ) )
+					return t.values + slot * value_size;
+			}
+
+			it->table = ( it->table == 1 ? 0 : 2 );
+			it->pos = 0;
+		}
+	}
+
+	/* initializes an iterator for iter_next_hash() */
+	void iter_init_hash( t_idx idx, iter *it )
+	{
+		it->table = 0;
+		it->pos = home_group( cur, idx );
+		it->step = 0;
+		it->mask = group_match( cur.ctrl + it->pos * GROUP, idx_tag( idx ) );
+	}
+
+	/* when called repeatedly, returns the values of all entries for a given index */
+	void *iter_next_hash( t_idx idx, iter *it )
+	{
+		while ( it->table < 2 )
+		{
+			table &t = ( it->table == 1 ? old : cur );
+
+			while ( it->mask )
+			{
+				size_t slot = it->pos * GROUP + __builtin_ctz( it->mask );
+				it->mask &= it->mask - 1;
+				if ( t.idx[ slot ] == idx )
+					return t.values + slot * value_size;
+			}
+
+			/* a group with an empty slot ends the probe sequence, then look in the old table */
+			if ( group_match( t.ctrl + it->pos * GROUP, CTRL_EMPTY ) || ++it->step == t.ngroups )
+			{
+				if ( it->table == 0 && old.ngroups )
+				{
+					it->table = 1;
+					it->pos = home_group( old, idx );
+					it->step = 0;
+					it->mask = group_match( old.ctrl + it->pos * GROUP, idx_tag( idx ) );
+				}
+				else
+					it->table = 2;
+				continue;
+			}
+
+			it->pos = ( it->pos + it->step ) & ( t.ngroups - 1 );
+			it->mask = group_match( t.ctrl + it->pos * GROUP, idx_tag( idx ) );
+		}
+
+		return NULL;
+	}
+
+private:
+	swiss_table ( const swiss_table& );
+	swiss_table& operator=( const swiss_table& );
+};
+
+#endif